@@ -5,6 +5,24 @@
 #include <sys/wait.h>
 #include <string.h>
 #include <signal.h>
+#include "engine.h"
+
+/*
+ * what a player knows of the cards, as bitmasks with card (suit, rank) at
+ * bit suit * 13 + rank, suits in SCDH order and ranks from 2 to A. Every
+ * card is in exactly one of held (in this hand), played (in this round,
+ * by anyone) and unknown (in another hand, or out of the deal)
+ */
+typedef struct Hand {
+    unsigned long long held;
+    unsigned long long played;
+    unsigned long long unknown;
+} Hand;
+
+/* the bit of a card, the bits of a whole suit, and all 52 cards */
+#define CARD_BIT(suit, rank) (1ULL << ((suit) * 13 + (rank)))
+#define SUIT_MASK(suit) (0x1FFFULL << ((suit) * 13))
+#define ALL_CARDS ((1ULL << 52) - 1)
 
 /* takes in error code, then print stderr message and exit program */
 void error(int errorCode) {
@@ -215,117 +233,112 @@ char suit_index_to_char(int i) {
     return 'S';
 }
 
-/* put newround card message to hand card array */
-void get_hand(char message[100], int playerNumber, int hand[4][13]) {
-    for (int i = 0; i < 4; i++) {
-        for (int j = 0; j < 13; j++) {
-            hand[i][j] = 0;
-        }
-    }
+/* put the cards of a newround message into hand */
+void get_hand(const char *cards, int playerNumber, Hand *hand) {
+    hand->held = 0;
+    hand->played = 0;
     for (int i = 0; i < (52 / playerNumber); i++) {
-        int suit = char_to_suit_index(message[9 + 3 * i + 1]);
-        int rank = char_to_rank_index(message[9 + 3 * i]);
-        hand[suit][rank] = 1;
+        hand->held |= CARD_BIT(char_to_suit_index(cards[3 * i + 1]),
+                char_to_rank_index(cards[3 * i]));
     }
+    hand->unknown = ALL_CARDS & ~hand->held;
 }
 
-/* check if all clubs which are smaller than i have already played
+/* check if all clubs which are smaller than rank have already been played
  * if yes, return 1, if no, return 0;
  */
-int check_played_club(int i, int hand[4][13]) {
-    if (i == 0) {
-        return 1;
-    } else {
-        for (int j = 0; j < i; j++) {
-            if (hand[1][j] == 0 || hand[1][j] == 1) {
-                return 0;
-            }
-        }
-        return 1;
-    }
+int check_played_club(int rank, const Hand *hand) {
+    unsigned long long lower = CARD_BIT(1, rank) - CARD_BIT(1, 0);
+    return (hand->played & lower) == lower;
+}
+
+/* put the card with given suit and rank into card, e.g. "TC" */
+void choose_card(int suit, int rank, char card[3]) {
+    card[0] = rank_index_to_char(rank);
+    card[1] = suit_index_to_char(suit);
+    card[2] = '\0';
 }
 
 /* send played card to stdout */
-void send_card(int suit, int rank) {
-    fprintf(stdout, "%c%c\n", rank_index_to_char(rank),
-            suit_index_to_char(suit));
+void send_card(char card[3]) {
+    fprintf(stdout, "%s\n", card);
     fflush(stdout);
 }
 
-/* play the lowest available card in a given suit */
-int play_lowest_card(int suit, int hand[4][13]) {
-    for (int i = 0; i < 13; i++) {
-        if (hand[suit][i] == 1) {
-            send_card(suit, i);
-            hand[suit][i] = 2;
-            return 1;
-        }
+/* take the card at bit index out of hand and put it into card */
+void play_card(int index, Hand *hand, char card[3]) {
+    choose_card(index / 13, index % 13, card);
+    hand->held &= ~(1ULL << index);
+    hand->played |= 1ULL << index;
+}
+
+/* choose the lowest available card in a given suit */
+int play_lowest_card(int suit, Hand *hand, char card[3]) {
+    unsigned long long cards = hand->held & SUIT_MASK(suit);
+    if (cards == 0) {
+        return 0;
     }
-    return 0;
+    play_card(__builtin_ctzll(cards), hand, card);
+    return 1;
 }
 
-/* play the highest available card in a given suit */
-int play_highest_card(int suit, int hand[4][13]) {
-    for (int i = 12; i >= 0; i--) {
-        if (hand[suit][i] == 1) {
-            send_card(suit, i);
-            hand[suit][i] = 2;
-            return 1;
-        }
+/* choose the highest available card in a given suit */
+int play_highest_card(int suit, Hand *hand, char card[3]) {
+    unsigned long long cards = hand->held & SUIT_MASK(suit);
+    if (cards == 0) {
+        return 0;
     }
-    return 0;
+    play_card(63 - __builtin_clzll(cards), hand, card);
+    return 1;
 }
 
-/* lead the trick */
-void lead_card(int hand[4][13]) {
-    for (int i = 0; i < 13; ++i) {
-        if (hand[1][i] == 1) {
-            if (check_played_club(i, hand)) {
-                send_card(1, i);
-                hand[1][i] = 2;
-                return;
-            } else {
-                break;
-            }
-        }
+/*
+ * choose the card to lead the trick: the lowest club once every lower
+ * club is out, else the lowest diamond, heart, spade or club
+ */
+void lead_card(Hand *hand, char card[3]) {
+    unsigned long long clubs = hand->held & SUIT_MASK(1);
+    if (clubs != 0 && check_played_club(__builtin_ctzll(clubs) - 13, hand)) {
+        play_card(__builtin_ctzll(clubs), hand, card);
+        return;
     }
 
-    if (play_lowest_card(2, hand)) {
+    if (play_lowest_card(2, hand, card)) {
         return;
-    } else if (play_lowest_card(3, hand)) {
+    } else if (play_lowest_card(3, hand, card)) {
         return;
-    } else if (play_lowest_card(0, hand)) {
+    } else if (play_lowest_card(0, hand, card)) {
         return;
-    } else if (play_lowest_card(1, hand)) {
+    } else if (play_lowest_card(1, hand, card)) {
         return;
     }
 }
 
-/* follow the trick according to a given leading suit
+/* choose the card to follow the trick according to a given leading suit
  * and whether is the last to play
  */
-void follow_card(int hand[4][13], int leadingSuit, int turnNo,
-        int playerNumber) {
-    if (play_lowest_card(leadingSuit, hand)) {
+void follow_card(Hand *hand, int leadingSuit, int turnNo,
+        int playerNumber, char card[3]) {
+    if (play_lowest_card(leadingSuit, hand, card)) {
         return;
     } else if (turnNo == playerNumber - 1) {
-        if (play_highest_card(3, hand)) {
+        if (play_highest_card(3, hand, card)) {
             return;
-        } else if (play_highest_card(2, hand)) {
+        } else if (play_highest_card(2, hand, card)) {
             return;
-        } else if (play_highest_card(1, hand)) {
+        } else if (play_highest_card(1, hand, card)) {
             return;
-        } else if (play_highest_card(0, hand)) {
+        } else if (play_highest_card(0, hand, card)) {
             return;
         }
     } else {
-        if (play_highest_card(1, hand)) {
+        if (play_highest_card(1, hand, card)) {
             return;
-        } else if (play_highest_card(2, hand)) {
+        } else if (play_highest_card(2, hand, card)) {
             return;
-        } else if (play_highest_card(3, hand)) {
+        } else if (play_highest_card(3, hand, card)) {
             return;
-        } else if (play_highest_card(0, hand)) {
+        } else if (play_highest_card(0, hand, card)) {
             return;
         }
     }
@@ -341,19 +354,22 @@ void get_scores(char scores[100], char message[100]) {
     }
 }
 
-/* update the card condition according to played message */
-void update_hand(int hand[4][13], char message[100], int turnNo,
+/*
+ * mark the card of a played message as played, it must not be one still
+ * held, as this player's own cards leave the hand when chosen
+ */
+void update_hand(Hand *hand, const char *card, int turnNo,
         int *leadingSuit) {
-    int rank = (char_to_rank_index(message[7]));
-    int suit = (char_to_suit_index(message[8]));
-    if (hand[suit][rank] == 0 || hand[suit][rank] == 2) {
-        hand[suit][rank] = 2;
-        if (turnNo == 0) {
-            *leadingSuit = suit;
-        }
-    } else {
+    int rank = (char_to_rank_index(card[0]));
+    int suit = (char_to_suit_index(card[1]));
+    if (hand->held & CARD_BIT(suit, rank)) {
         error(5);
     }
+    hand->played |= CARD_BIT(suit, rank);
+    hand->unknown &= ~CARD_BIT(suit, rank);
+    if (turnNo == 0) {
+        *leadingSuit = suit;
+    }
 }
 
 /* set the score string to 0s */
@@ -368,64 +384,110 @@ void scores_init(char scores[100], int playerNumber) {
 }
 
 /* print hand cards to stderr */
-void display_hand(int hand[4][13]) {
+void display_hand(const Hand *hand) {
     char temp[100] = "";
     int length = 0;
-    for (int i = 0; i < 4; i++) {
-        for (int j = 0; j < 13; j++) {
-            if (hand[i][j] == 1) {
-                temp[length] = rank_index_to_char(j);
-                length++;
-                temp[length] = suit_index_to_char(i);
-                length++;
-                temp[length] = ',';
-                length++;
-            }
-        }
-    }
-    if (length == 0) {
-        temp[0] = '\0';
-    } else {
-        temp[length - 1] = '\0';
+    for (unsigned long long held = hand->held; held != 0;
+            held &= held - 1) {
+        int index = __builtin_ctzll(held);
+        temp[length++] = rank_index_to_char(index % 13);
+        temp[length++] = suit_index_to_char(index / 13);
+        temp[length++] = ',';
     }
+    temp[(length == 0) ? 0 : length - 1] = '\0';
     fprintf(stderr, "Hand: %s\n", temp);
 }
 
 /* print played cards to stderr */
-void display_played(int hand[4][13]) {
+void display_played(const Hand *hand) {
     for (int i = 0; i < 4; i++) {
         char temp[100] = "";
         int length = 0;
         fprintf(stderr, "Played (%c): ", suit_index_to_char(i));
-        for (int j = 0; j < 13; j++) {
-            if (hand[i][j] == 2) {
-                temp[length] = rank_index_to_char(j);
-                length++;
-                temp[length] = ',';
-                length++;
-            }
-        }
-        if (length == 0) {
-            temp[0] = '\0';
-        } else {
-            temp[length - 1] = '\0';
+        for (unsigned long long played = hand->played & SUIT_MASK(i);
+                played != 0; played &= played - 1) {
+            temp[length++] = rank_index_to_char(__builtin_ctzll(played) % 13);
+            temp[length++] = ',';
         }
+        temp[(length == 0) ? 0 : length - 1] = '\0';
         fprintf(stderr, "%s\n", temp);
     }
 }
 
 /* print information to stderr */
-void output_stderr(char message[100], int hand[4][13], char scores[100]) {
+void output_stderr(char message[100], const Hand *hand, char scores[100]) {
     display_hand(hand);
     display_played(hand);
     fprintf(stderr, "Scores: %s\n", scores);
 }
 
+#ifdef ENGINE
+/* one player's state when clubber is loaded into clubhub, see engine.h */
+typedef struct Clubber {
+    Hand hand;
+    int playerNumber;
+    int turnNo;
+    int leadingSuit;
+} Clubber;
+
+/* set up a player of a game with playerNumber players */
+void *engine_start(int playerNumber, char id) {
+    Clubber *clubber = (Clubber *)calloc(1, sizeof(Clubber));
+    if (clubber != NULL) {
+        clubber->playerNumber = playerNumber;
+    }
+    return clubber;
+}
+
+/* take the hand of a new round */
+void engine_newround(void *player, const char *hand) {
+    Clubber *clubber = (Clubber *)player;
+    get_hand(hand, clubber->playerNumber, &clubber->hand);
+}
+
+/* choose the card to lead a trick */
+void engine_lead(void *player, char card[3]) {
+    lead_card(&((Clubber *)player)->hand, card);
+}
+
+/* choose the card to follow the trick */
+void engine_follow(void *player, char card[3]) {
+    Clubber *clubber = (Clubber *)player;
+    follow_card(&clubber->hand, clubber->leadingSuit, clubber->turnNo,
+            clubber->playerNumber, card);
+}
+
+/* note a card played by any player */
+void engine_played(void *player, const char *card) {
+    Clubber *clubber = (Clubber *)player;
+    update_hand(&clubber->hand, card, clubber->turnNo, &clubber->leadingSuit);
+    clubber->turnNo++;
+}
+
+/* start counting turns again for the next trick */
+void engine_trickover(void *player) {
+    ((Clubber *)player)->turnNo = 0;
+}
+
+/* scores are only displayed by the process, so nothing to keep */
+void engine_scores(void *player, const int *scores) {
+}
+
+/* the game is over */
+void engine_end(void *player) {
+    free(player);
+}
+
+/* the table clubhub looks up by ENGINE_SYMBOL */
+const Engine clubs_engine = {ENGINE_VERSION, engine_start, engine_newround,
+        engine_lead, engine_follow, engine_played, engine_trickover,
+        engine_scores, engine_end};
+#else
 int main(int argc, char *argv[]) {
     signal(SIGPIPE, SIG_IGN);
     check_argu(argc, argv);
     char scores[100];
-    int hand[4][13];
+    Hand hand = {0, 0, ALL_CARDS};
     int playerNumber = atoi(argv[1]);
     int turnNo = 0;
     int leadingSuit = 0;
@@ -437,22 +499,25 @@ int main(int argc, char *argv[]) {
 
     while (1) {
         char message[100] = "";
+        char card[3];
         get_message(message);
         switch (message_category_check(message)) {
             case 1:
-                get_hand(message, playerNumber, hand);
+                get_hand(message + 9, playerNumber, &hand);
                 break;
             case 2:
-                lead_card(hand);
+                lead_card(&hand, card);
+                send_card(card);
                 break;
             case 3:
                 turnNo = 0;
                 break;
             case 4:
-                follow_card(hand, leadingSuit, turnNo, playerNumber);
+                follow_card(&hand, leadingSuit, turnNo, playerNumber, card);
+                send_card(card);
                 break;
             case 5:
-                update_hand(hand, message, turnNo, &leadingSuit);
+                update_hand(&hand, message + 7, turnNo, &leadingSuit);
                 turnNo++;
                 break;
             case 6:
@@ -462,9 +527,10 @@ int main(int argc, char *argv[]) {
                 exit(0);
                 break;
         }
-        output_stderr(message, hand, scores);
+        output_stderr(message, &hand, scores);
     }
     return 0;
 }
+#endif
 
 
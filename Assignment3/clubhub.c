@@ -5,6 +5,44 @@
 #include <sys/wait.h>
 #include <string.h>
 #include <signal.h>
+#include <dlfcn.h>
+#include <time.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include "engine.h"
+
+/*
+ * a player: a process the hub talks to over pipes "in" and "out", or with
+ * engine set, a strategy loaded into the hub that is called directly
+ */
+typedef struct Player {
+    FILE *in;
+    FILE *out;
+    const Engine *engine;
+    void *state;
+} Player;
+
+/*
+ * a hand as a bitboard: card (suit, rank) is bit suit * 13 + rank, with
+ * suits in SCDH order and ranks from 2 to A, so the bits in order are the
+ * hand sorted as it is shown
+ */
+typedef unsigned long long Hand;
+
+/* the bit of a card, and the bits of a whole suit */
+#define CARD_BIT(suit, rank) (1ULL << ((suit) * 13 + (rank)))
+#define SUIT_MASK(suit) (0x1FFFULL << ((suit) * 13))
+
+/* print each game to stdout, off for the games of a tournament */
+int transcript = 1;
+
+/*
+ * the strategy of each in-process player, loaded by the first game this
+ * process plays and kept for the games after it
+ */
+const Engine *engines[4];
 
 /* takes in error code, then print stderr message and exit program */
 void error(int errorCode) {
@@ -47,6 +85,10 @@ void error(int errorCode) {
             fprintf(stderr, "SIGINT caught\n");
             exit(9);
             break;
+        case 10:
+            fprintf(stderr, "Invalid configuration\n");
+            exit(10);
+            break;
     }
 }
 
@@ -63,163 +105,107 @@ void check_argu(int argc, char *argv[]) {
     }
 }
 
-/* return the maximum line length of the file */
-int get_max_length(FILE *f) {
-    int maxLineLength = 0;
-    int lineLength = 0;
-    char lastCh;
-    char ch;
-    rewind(f);
-    while ((ch = fgetc(f)) != EOF) {
-        if (ch == '\n') {
-            if (lineLength > maxLineLength) {
-                maxLineLength = lineLength;
-            }
-            lineLength = 0;
-        } else {
-            lastCh = ch;
-            lineLength++;
-        }
+/* rank and suit index + 1 of each character of a decks file, 0 if none */
+const unsigned char rankCodes[256] = {['2'] = 1, ['3'] = 2, ['4'] = 3,
+        ['5'] = 4, ['6'] = 5, ['7'] = 6, ['8'] = 7, ['9'] = 8, ['T'] = 9,
+        ['J'] = 10, ['Q'] = 11, ['K'] = 12, ['A'] = 13};
+const unsigned char suitCodes[256] = {['S'] = 1, ['C'] = 2, ['D'] = 3,
+        ['H'] = 4};
+
+/*
+ * check one card line of a decks file, text[0..length) without its
+ * newline, and add its cards to deck, card (suit, rank) stored as
+ * suit * 13 + rank. A line is cards separated by commas, optionally
+ * ending in one, and the last line may only miss its newline after a
+ * comma. Any error, a card already in the deck (its bit set in seen) or
+ * more than 52 cards in deck will cause error(4)
+ */
+void read_card_line(const char *text, int length, int newline,
+        unsigned char *deck, int *cardsP, Hand *seen) {
+    if ((length + newline) % 3 == 2) {
+        error(4);
     }
-    if (lastCh != '\n') {
-        if (lineLength > maxLineLength) {
-            maxLineLength = lineLength;
+    for (int i = 0; i < length; i += 3) {
+        int rank = rankCodes[(unsigned char)text[i]];
+        int suit = (i + 1 < length) ?
+                suitCodes[(unsigned char)text[i + 1]] : 0;
+        if (rank == 0 || suit == 0 ||
+                (i + 2 < length && text[i + 2] != ',') || *cardsP >= 52 ||
+                (*seen & CARD_BIT(suit - 1, rank - 1))) {
+            error(4);
         }
+        *seen |= CARD_BIT(suit - 1, rank - 1);
+        deck[(*cardsP)++] = (suit - 1) * 13 + rank - 1;
     }
-    return maxLineLength;
 }
 
-/* return the number of decks contained in a file */
-int get_deck_num(FILE *f, int maxLineLength) {
-    int deckNumber = 1;
-    char *line = NULL;
-    rewind(f);
-    line = (char *)malloc(sizeof(char) * (maxLineLength + 1));
-    while (fgets(line, maxLineLength + 1, f) != NULL) {
-        if (line[0] == '.') {
-            if (line[1] == '\n' && line[2] == '\0') {
-                deckNumber++;
-            } else {
+/*
+ * check the decks file in text and store its decks in decks, 52 cards
+ * each, return the number of decks. Decks are separated by "." lines,
+ * "#" lines are comments and empty lines are skipped. Any error will
+ * cause error(4)
+ */
+int read_decks(const char *text, size_t size, unsigned char *decks) {
+    int deckNumber = 0, cards = 0;
+    Hand seen = 0;
+    const char *end = text + size;
+    while (text < end) {
+        const char *newline = memchr(text, '\n', end - text);
+        int length = ((newline == NULL) ? end : newline) - text;
+        if (text[0] == '.') {
+            if (length != 1 || newline == NULL || cards != 52) {
                 error(4);
             }
+            deckNumber++;
+            cards = 0;
+            seen = 0;
+        } else if (length != 0 && text[0] != '#') {
+            read_card_line(text, length, newline != NULL,
+                    decks + (size_t)deckNumber * 52, &cards, &seen);
         }
+        text += length + 1;
     }
-    free(line);
-    return deckNumber;
-}
-
-/* check if the file contains valid decks */
-void check_file_validity(FILE *f, int maxLineLength) {
-    char *line = NULL;
-    rewind(f);
-    line = (char *)malloc(sizeof(char) * (maxLineLength + 1));
-    while (fgets(line, maxLineLength + 2, f) != NULL) {
-        if (line[0] == '.') {
-        } else if (line[0] == '\n') {
-        } else if (line[0] == '#') {
-        } else {
-            if (strlen(line) % 3 == 0 || strlen(line) % 3 == 1) {
-                for (int i = 0; (line[i] != '\n') && (line[i] != '\0'); i++) {
-                    char c = line[i];
-                    if (i % 3 == 0) {
-                        if ((c >= '2' && c <= '9') || c == 'T' || c == 'J' ||
-                                c == 'Q' || c == 'K' || c == 'A') {
-                        } else {
-                            error(4);
-                        }
-                    } else if (i % 3 == 1) {
-                        if (c == 'S' || c == 'C' || c == 'D' || c == 'H') {
-                        } else {
-                            error(4);
-                        }
-                    } else if (i % 3 == 2) {
-                        if (c != ',') {
-                            printf("here%s", line);
-                            error(4);
-                        }
-                    }
-                }
-            } else {
-
-                error(4);
-            }
-        }
+    if (cards != 52) {
+        error(4);
     }
-    free(line);
+    return deckNumber + 1;
 }
 
-/* initialize the empty deck array */
-char **decks_init(int deckNumber) {
-    int i = 0, j = 0;
-    char **decks;
-    decks = (char**)malloc(sizeof(char *) * deckNumber);
-    for (i = 0; i < deckNumber; i++) {
-        decks[i] = (char *)malloc(sizeof(char) * 105);
-        for (j = 0; j < 104; j++) {
-            decks[i][j] = '\0';
-        }
-        decks[i][j] = '\0';
+/*
+ * map the decks file into memory and read it in one pass, into one array
+ * of 52 cards per deck. A file that cannot be opened will cause error(3),
+ * one that cannot be read error(4)
+ */
+void open_decks_file(char *argv[], int *deckNumberP, unsigned char **decks) {
+    int fd = open(argv[1], O_RDONLY);
+    struct stat info;
+    if (fd < 0) {
+        error(3);
     }
-    return decks;
-}
-
-/* read the deck file and store deck in the deck array */
-void read_decks(int deckNumber, char ***decks, FILE *f, int maxLineLength) {
-    int currentDeck = 0;
-    int currentPosition = 0;
-    char *line = NULL;
-    rewind(f);
-    line = (char *)malloc(sizeof(char) * (maxLineLength + 1));
-    while (fgets(line, maxLineLength + 2, f) != NULL) {
-        if (line[0] == '.') {
-            if (currentPosition != 104) {
-
-                error(4);
-            }
-            currentDeck++;
-            currentPosition = 0;
-        } else if (line[0] == '\n') {
-        } else if (line[0] == '#') {
-        } else {
-            for (int i = 0; (line[i] != '\n') && (line[i] != '\0'); i++) {
-                if (line[i] != ',') {
-                    if (currentPosition >= 104) {
-
-                        error(4);
-                    }
-                    (*decks)[currentDeck][currentPosition] = line[i];
-                    currentPosition++;
-                }
-            }
-        }
+    if (fstat(fd, &info) < 0 || !S_ISREG(info.st_mode) ||
+            info.st_size == 0) {
+        error(4);
     }
-    if (currentPosition != 104) {
+    /* populated up front, faulting pages in one by one costs a fifth */
+    char *text = (char *)mmap(NULL, info.st_size, PROT_READ,
+            MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    if (text == MAP_FAILED) {
         error(4);
     }
-    free(line);
-}
-
-/* open the deck file, check file validity and read the file */
-void open_decks_file(char *argv[], int *deckNumberP, char ***decks) {
-    FILE *f = fopen(argv[1], "r");
-    int maxLineLength = 0;
-    if (f == NULL) {
-        error(3);
+    /* each deck takes at least 104 bytes of the file */
+    *decks = (unsigned char *)malloc(52 * (info.st_size / 104 + 1));
+    if (*decks == NULL) {
+        error(4);
     }
-    maxLineLength = get_max_length(f);
-    *deckNumberP = get_deck_num(f, maxLineLength);
-    int deckNumber = *deckNumberP;
-    check_file_validity(f, maxLineLength);
-    *decks = decks_init(deckNumber);
-    read_decks(deckNumber, decks, f, maxLineLength);
+    *deckNumberP = read_decks(text, info.st_size, *decks);
+    munmap(text, info.st_size);
+    close(fd);
 }
 
-/* initializer player's hand card array */
-void player_hand_init(char playerHand[4][78]) {
+/* empty every player's hand */
+void player_hand_init(Hand playerHand[4]) {
     for (int i = 0; i < 4; i++) {
-        for (int j = 0; j < 78; j++) {
-            playerHand[i][j] = '\0';
-        }
+        playerHand[i] = 0;
     }
 }
 
@@ -321,69 +307,37 @@ char suit_index_to_char(int i) {
     return 'S';
 }
 
-/* sort the players hand array to SCDH order */
-void sort_hands(char playerHand[4][78], int playerNumber) {
-    for (int player = 0; player < playerNumber; player++) {
-        int hand[4][13];
-        for (int i = 0; i < 4; i++) {
-            for (int j = 0; j < 13; j++) {
-                hand[i][j] = 0;
-            }
-        }
-        for (int i = 0; i < (52 / playerNumber); i++) {
-            int suit = char_to_suit_index(playerHand[player][3 * i + 1]);
-            int rank = char_to_rank_index(playerHand[player][3 * i]);
-            hand[suit][rank] = 1;
-        }
-        int length = 0;
-        for (int i = 0; i < 4; i++) {
-            for (int j = 0; j < 13; j++) {
-                if (hand[i][j] == 1) {
-                    playerHand[player][length] = rank_index_to_char(j);
-                    length++;
-                    playerHand[player][length] = suit_index_to_char(i);
-                    length++;
-                    playerHand[player][length] = ',';
-                    length++;
-                }
-            }
-        }
-        if (length == 0) {
-            playerHand[player][0] = '\0';
-        } else {
-            playerHand[player][length - 1] = '\0';
-        }
-
-    }
-
+/* write a hand as the protocol shows it, e.g. "2S,TC,AH", into text */
+void render_hand(Hand hand, char text[78]) {
+    int length = 0;
+    while (hand != 0) {
+        int card = __builtin_ctzll(hand);
+        hand &= hand - 1;
+        text[length++] = rank_index_to_char(card % 13);
+        text[length++] = suit_index_to_char(card / 13);
+        text[length++] = ',';
+    }
+    text[(length == 0) ? 0 : length - 1] = '\0';
 }
 
-/* distribute cards from a given deck */
-void deal_cards(char playerHand[4][78], int playerNumber, char **decks,
+/* distribute cards from a given deck, leaving out 2D for 3 players */
+void deal_cards(Hand playerHand[4], int playerNumber, unsigned char *decks,
         int roundNo) {
-    int handIndex = 0;
     int currentPlayer = 0;
+    player_hand_init(playerHand);
     for (int i = 0; i < 52; i++) {
-        if (playerNumber == 3 && decks[roundNo][i * 2] == '2' &&
-                decks[roundNo][i * 2 + 1] == 'D') {
+        int card = decks[roundNo * 52 + i];
+        if (playerNumber == 3 && card == 2 * 13) {
 
         } else {
-            playerHand[currentPlayer][handIndex * 3] = decks[roundNo][i * 2];
-            playerHand[currentPlayer][handIndex * 3 + 1] =
-                    decks[roundNo][i * 2 + 1];
-            playerHand[currentPlayer][handIndex * 3 + 2] = ',';
+            playerHand[currentPlayer] |= 1ULL << card;
             if (currentPlayer == playerNumber - 1) {
                 currentPlayer = 0;
-                handIndex++;
             } else {
                 currentPlayer++;
             }
         }
     }
-    for (int i = 0; i < playerNumber; i++) {
-        playerHand[i][handIndex * 3 - 1] = '\0';
-    }
-    sort_hands(playerHand, playerNumber);
 }
 
 /* run players, any system call failure will cause error(5) */
@@ -395,6 +349,8 @@ void run_clubbers(int player, char *argv[], int playerNumber,
     if (dup2(pipeIn[player][1], 1) < 0) {
         error(5);
     }
+    close(pipeOut[player][0]);
+    close(pipeIn[player][1]);
     if (freopen("/dev/null", "w", stderr) == NULL) {
         error(5);
     }
@@ -407,61 +363,144 @@ void run_clubbers(int player, char *argv[], int playerNumber,
     error(5);
 }
 
-/* fork and run processes */
-void fork_players(int playerNumber, int pid[4], char *argv[], FILE *fileIn[4],
-        FILE *fileOut[4]) {
+/* return 1 if prog is a strategy to load in-process, a name ending ".so" */
+int is_engine(char *prog) {
+    int length = strlen(prog);
+    return length > 3 && strcmp(prog + length - 3, ".so") == 0;
+}
+
+/*
+ * start the strategy in the shared object named for player, loading it if
+ * this process has not yet. Any failure will cause error(5). A name
+ * without '/' is taken from the current directory, as execl() would
+ */
+void load_engine(int player, char *argv[], int playerNumber,
+        Player *players) {
+    if (engines[player] == NULL) {
+        char path[strlen(argv[3 + player]) + 3];
+        sprintf(path, "%s%s", (strchr(argv[3 + player], '/') == NULL) ?
+                "./" : "", argv[3 + player]);
+        void *object = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+        if (object == NULL || (engines[player] =
+                (const Engine *)dlsym(object, ENGINE_SYMBOL)) == NULL ||
+                engines[player]->version != ENGINE_VERSION) {
+            error(5);
+        }
+    }
+    players[player].engine = engines[player];
+    if ((players[player].state = engines[player]->start(playerNumber,
+            'A' + player)) == NULL) {
+        error(5);
+    }
+}
+
+/*
+ * in the process forked for player, close every pipe end but the two it
+ * runs on: those of the players forked before it, which the hub holds as
+ * FILEs, and those of the players still to come
+ */
+void close_other_pipes(int player, char *argv[], int playerNumber,
+        Player players[4], int pipeIn[4][2], int pipeOut[4][2],
+        int pipeErr[4][2]) {
+    for (int j = 0; j < playerNumber; j++) {
+        if (is_engine(argv[3 + j])) {
+            continue;
+        } else if (j < player) {
+            close(fileno(players[j].in));
+            close(fileno(players[j].out));
+            continue;
+        } else if (j > player) {
+            close(pipeIn[j][1]);
+            close(pipeOut[j][0]);
+        }
+        close(pipeIn[j][0]);
+        close(pipeOut[j][1]);
+        close(pipeErr[j][0]);
+        close(pipeErr[j][1]);
+    }
+}
+
+/* fork and run processes, or load the players that are shared objects */
+void fork_players(int playerNumber, int pid[4], char *argv[],
+        Player players[4]) {
     int pipeIn[4][2], pipeOut[4][2], pipeErr[4][2];
-    for (int i = 0; i < 4; i++) {
-        if (pipe(pipeIn[i]) < 0 || pipe(pipeOut[i]) < 0 ||
-                pipe(pipeErr[i]) < 0) {
+    for (int i = 0; i < playerNumber; i++) {
+        if (!is_engine(argv[3 + i]) && (pipe(pipeIn[i]) < 0 ||
+                pipe(pipeOut[i]) < 0 || pipe(pipeErr[i]) < 0)) {
             error(5);
         }
     }
 
     for (int i = 0; i < playerNumber; i++) {
-        if((pid[i] = fork()) == 0) {
-            for (int j = 0; j < playerNumber; j++) {
-                if (i != j) {
-                    close(pipeIn[j][1]);
-                }
-                
-            }
+        players[i].engine = NULL;
+        if (is_engine(argv[3 + i])) {
+            load_engine(i, argv, playerNumber, players);
+        } else if((pid[i] = fork()) == 0) {
+            close_other_pipes(i, argv, playerNumber, players, pipeIn,
+                    pipeOut, pipeErr);
             run_clubbers(i, argv, playerNumber, pipeIn, pipeOut, pipeErr);
         } else {
             close(pipeIn[i][1]);
             close(pipeOut[i][0]);
+            close(pipeErr[i][0]);
+            close(pipeErr[i][1]);
 
-            if ((fileIn[i] = fdopen(pipeIn[i][0], "r")) == NULL) {
+            if ((players[i].in = fdopen(pipeIn[i][0], "r")) == NULL) {
                 error(5);
             }
-            if ((fileOut[i] = fdopen(pipeOut[i][1], "w")) == NULL) {
+            if ((players[i].out = fdopen(pipeOut[i][1], "w")) == NULL) {
                 error(5);
             }
         }
     }
 }
 
+/* close the pipes to the player processes and wait for them to exit */
+void close_players(int playerNumber, int pid[4], Player players[4]) {
+    for (int i = 0; i < playerNumber; i++) {
+        if (players[i].engine == NULL) {
+            fclose(players[i].in);
+            fclose(players[i].out);
+            waitpid(pid[i], NULL, 0);
+        }
+    }
+}
+
 /* print hand card of each player */
-void display_hand(char playerHand[4][78], int playerNumber) {
+void display_hand(Hand playerHand[4], int playerNumber) {
+    if (!transcript) {
+        return;
+    }
+    char text[78];
     for (int i = 0; i < playerNumber; i++) {
-        fprintf(stdout, "Player (%c): %s\n", 'A' + i, playerHand[i]);
+        render_hand(playerHand[i], text);
+        fprintf(stdout, "Player (%c): %s\n", 'A' + i, text);
     }
 }
 
 /* send newround message to players */
-void give_card_to_player(char playerHand[4][78], int playerNumber,
-        FILE *fileOut[4]) {
+void give_card_to_player(Hand playerHand[4], int playerNumber,
+        Player players[4]) {
+    char text[78];
     for (int i = 0; i < playerNumber; i++) {
-        fprintf(fileOut[i], "newround %s\n", playerHand[i]);
-        fflush(fileOut[i]);
+        render_hand(playerHand[i], text);
+        if (players[i].engine != NULL) {
+            players[i].engine->newround(players[i].state, text);
+            continue;
+        }
+        fprintf(players[i].out, "newround %s\n", text);
+        fflush(players[i].out);
     }
 }
 
 /* check if all players started successfully, if not close the hub*/
-void check_players_started(int playerNumber, FILE *fileIn[4]) {
+void check_players_started(int playerNumber, Player players[4]) {
     for (int i = 0; i < playerNumber; ++i) {
         int ch;
-        if((ch = fgetc(fileIn[i])) == EOF) {
+        if (players[i].engine != NULL) {
+            continue;
+        }
+        if((ch = fgetc(players[i].in)) == EOF) {
             error(5);
         } else if(ch != '-') {
             error(6);
@@ -479,13 +518,13 @@ void next_player(int *currentPlayer, int playerNumber) {
 }
 
 /* read the pipe file for the current player */
-void get_response(int currentPlayer, FILE *fileIn[4], char response[100]) {
+void get_response(Player *player, char response[100]) {
     for (int i = 0; i < 100; i++) {
         response[i] = '\0';
     }
     char ch;
     int i = 0;
-    while ((ch = fgetc(fileIn[currentPlayer])) != '\n') {
+    while ((ch = fgetc(player->in)) != '\n') {
         if (ch == EOF) {
             error(6);
         }
@@ -501,16 +540,44 @@ void get_response(int currentPlayer, FILE *fileIn[4], char response[100]) {
     }
 }
 
+/*
+ * ask the current player for a card, to lead the trick if lead is set,
+ * and put its response in response
+ */
+void ask_card(Player *player, int lead, char response[100]) {
+    if (player->engine == NULL) {
+        fprintf(player->out, lead ? "newtrick\n" : "yourturn\n");
+        fflush(player->out);
+        get_response(player, response);
+        return;
+    }
+    for (int i = 0; i < 100; i++) {
+        response[i] = '\0';
+    }
+    if (lead) {
+        player->engine->lead(player->state, response);
+    } else {
+        player->engine->follow(player->state, response);
+    }
+}
+
 /* print and send card played message */
-void declare_played(FILE *fileOut[4], char playedCard[4][2],
+void declare_played(Player players[4], char playedCard[4][2],
         int currentPlayer, int playerNumber, int type) {
+    char card[3] = {playedCard[currentPlayer][0],
+            playedCard[currentPlayer][1], '\0'};
     for (int i = 0; i < playerNumber; ++i) {
-        fprintf(fileOut[i], "played %c%c\n", playedCard[currentPlayer][0],
-                playedCard[currentPlayer][1]);
-        fflush(fileOut[i]);
+        if (players[i].engine != NULL) {
+            players[i].engine->played(players[i].state, card);
+            continue;
+        }
+        fprintf(players[i].out, "played %s\n", card);
+        fflush(players[i].out);
     }
     char p = 'A' + currentPlayer;
-    if (type == 0) {
+    if (!transcript) {
+        return;
+    } else if (type == 0) {
         fprintf(stdout, "Player %c led %c%c\n", p,
                 playedCard[currentPlayer][0], playedCard[currentPlayer][1]);
     } else {
@@ -519,81 +586,75 @@ void declare_played(FILE *fileOut[4], char playedCard[4][2],
     }
 }
 
-/* start new trick and send message to current player */
-void lead_card(int currentPlayer, FILE *fileOut[4], FILE *fileIn[4],
-        char playerHand[4][78], char playedCard[4][2], int playerNumber) {
-    fprintf(fileOut[currentPlayer], "newtrick\n");
-    fflush(fileOut[currentPlayer]);
-    char response[100];
-    get_response(currentPlayer, fileIn, response);
+/*
+ * return the bit of the card a player sent, such as "TC", any other
+ * message will cause error(7)
+ */
+Hand read_card(const char *response) {
     if (strlen(response) != 2) {
         error(7);
     }
-    char c = response[0];
-    if (!((c >= '2' && c <= '9') || c == 'T' || c == 'J' || c == 'Q' ||
-            c == 'K' || c == 'A')) {
+    const char *rank = strchr("23456789TJQKA", response[0]);
+    const char *suit = strchr("SCDH", response[1]);
+    if (rank == NULL || suit == NULL) {
         error(7);
     }
-    c = response[1];
-    if (!(c == 'S' || c == 'C' || c == 'D' || c == 'H')) {
-        error(7);
-    }
-    char *find = strstr(playerHand[currentPlayer], response);
-    if (find == NULL) {
+    return CARD_BIT(suit - "SCDH", rank - "23456789TJQKA");
+}
+
+/* take a card out of the current player's hand and tell everyone */
+void play_card(int currentPlayer, Player players[4],
+        Hand playerHand[4], char playedCard[4][2], int playerNumber,
+        Hand card, int type) {
+    int index = __builtin_ctzll(card);
+    playerHand[currentPlayer] &= ~card;
+    playedCard[currentPlayer][0] = rank_index_to_char(index % 13);
+    playedCard[currentPlayer][1] = suit_index_to_char(index / 13);
+    declare_played(players, playedCard, currentPlayer, playerNumber, type);
+}
+
+/* start new trick and send message to current player */
+void lead_card(int currentPlayer, Player players[4],
+        Hand playerHand[4], char playedCard[4][2], int playerNumber) {
+    char response[100];
+    ask_card(&players[currentPlayer], 1, response);
+    Hand card = read_card(response);
+    if ((playerHand[currentPlayer] & card) == 0) {
         error(8);
     }
-    playedCard[currentPlayer][0] = *find;
-    *find = '-';
-    find++;
-    playedCard[currentPlayer][1] = *find;
-    *find = '-';
-    declare_played(fileOut, playedCard, currentPlayer, playerNumber, 0);
+    play_card(currentPlayer, players, playerHand, playedCard, playerNumber,
+            card, 0);
 }
 
-/* follow the  trick and send message to current player */
-void follow_card(int currentPlayer, FILE *fileOut[4], FILE *fileIn[4],
-        char playerHand[4][78], char playedCard[4][2], int playerNumber,
+/*
+ * follow the trick and send message to current player, a card off the
+ * leading suit is only valid if the hand holds none of it
+ */
+void follow_card(int currentPlayer, Player players[4],
+        Hand playerHand[4], char playedCard[4][2], int playerNumber,
         char leadingSuit) {
-    fprintf(fileOut[currentPlayer], "yourturn\n");
-    fflush(fileOut[currentPlayer]);
     char response[100];
-    get_response(currentPlayer, fileIn, response);
-    if (strlen(response) != 2) {
-        error(7);
-    }
-    char c = response[0];
-    if (!((c >= '2' && c <= '9') || c == 'T' || c == 'J' ||
-            c == 'Q' || c == 'K' || c == 'A')) {
-        error(7);
-    }
-    c = response[1];
-    if (!(c == 'S' || c == 'C' || c == 'D' || c == 'H')) {
-        error(7);
-    }
-    char *find = strstr(playerHand[currentPlayer], response);
-    if (find == NULL) {
+    ask_card(&players[currentPlayer], 0, response);
+    Hand card = read_card(response);
+    Hand follow = playerHand[currentPlayer] &
+            SUIT_MASK(char_to_suit_index(leadingSuit));
+    if ((playerHand[currentPlayer] & card) == 0 ||
+            (follow != 0 && (follow & card) == 0)) {
         error(8);
     }
-    if (c != leadingSuit) {
-        for (int i = 0; i < strlen(playerHand[currentPlayer]); ++i) {
-            if (playerHand[currentPlayer][i] == leadingSuit) {
-                error(8);
-            }
-        }
-    }
-    playedCard[currentPlayer][0] = *find;
-    *find = '-';
-    find++;
-    playedCard[currentPlayer][1] = *find;
-    *find = '-';
-    declare_played(fileOut, playedCard, currentPlayer, playerNumber, 1);
+    play_card(currentPlayer, players, playerHand, playedCard, playerNumber,
+            card, 1);
 }
 
 /* send trick over message to all players */
-void trick_over(FILE *fileOut[4], int playerNumber) {
+void trick_over(Player players[4], int playerNumber) {
     for (int i = 0; i < playerNumber; ++i) {
-        fprintf(fileOut[i], "trickover\n");
-        fflush(fileOut[i]);
+        if (players[i].engine != NULL) {
+            players[i].engine->trickover(players[i].state);
+            continue;
+        }
+        fprintf(players[i].out, "trickover\n");
+        fflush(players[i].out);
     }
 }
 
@@ -647,30 +708,38 @@ void display_winner(int scores[4], int playerNumber) {
 }
 
 /* send gameover message to players */
-void send_game_over(FILE *fileOut[4], int playerNumber) {
+void send_game_over(Player players[4], int playerNumber) {
     for (int i = 0; i < playerNumber; ++i) {
-        fprintf(fileOut[i], "end\n");
-        fflush(fileOut[i]);
+        if (players[i].engine != NULL) {
+            players[i].engine->end(players[i].state);
+            continue;
+        }
+        fprintf(players[i].out, "end\n");
+        fflush(players[i].out);
     }
 }
 
 /* send score message to players */
-void send_score(FILE *fileOut[4], int playerNumber, int scores[4]) {
+void send_score(Player players[4], int playerNumber, int scores[4]) {
     for (int i = 0; i < playerNumber; ++i) {
-        if (playerNumber == 2) {
-            fprintf(fileOut[i], "scores %d,%d\n", scores[0], scores[1]);
-            fflush(fileOut[i]);
+        if (players[i].engine != NULL) {
+            players[i].engine->scores(players[i].state, scores);
+        } else if (playerNumber == 2) {
+            fprintf(players[i].out, "scores %d,%d\n", scores[0], scores[1]);
+            fflush(players[i].out);
         } else if (playerNumber == 3) {
-            fprintf(fileOut[i], "scores %d,%d,%d\n", scores[0], scores[1],
-                    scores[2]);
-            fflush(fileOut[i]);
+            fprintf(players[i].out, "scores %d,%d,%d\n", scores[0],
+                    scores[1], scores[2]);
+            fflush(players[i].out);
         } else {
-            fprintf(fileOut[i], "scores %d,%d,%d,%d\n", scores[0], scores[1], 
-                    scores[2], scores[3]);
-            fflush(fileOut[i]);
+            fprintf(players[i].out, "scores %d,%d,%d,%d\n", scores[0],
+                    scores[1], scores[2], scores[3]);
+            fflush(players[i].out);
         }
     }
-    if (playerNumber == 2) {
+    if (!transcript) {
+        return;
+    } else if (playerNumber == 2) {
         fprintf(stdout, "scores %d,%d\n", scores[0], scores[1]);
         fflush(stdout);
     } else if (playerNumber == 3) {
@@ -683,67 +752,220 @@ void send_score(FILE *fileOut[4], int playerNumber, int scores[4]) {
     }
 }
 
-/* calculate scores, check if game is over and send corresponding message */
-void round_over(int playerNumber, int goalPoint, int *roundNo, int deckNumber,
-        int scores[4], FILE *fileOut[4]) {
+/*
+ * calculate scores, check if game is over and send corresponding message
+ * return 1 if the game is over, otherwise return 0
+ */
+int round_over(int playerNumber, int goalPoint, int *roundNo, int deckNumber,
+        int scores[4], Player players[4]) {
     for (int i = 0; i < playerNumber; ++i) {
         if (scores[i] >= goalPoint) {
-            send_score(fileOut, playerNumber, scores);
-            display_winner(scores, playerNumber);
-            send_game_over(fileOut, playerNumber);
-            exit(0);
+            send_score(players, playerNumber, scores);
+            if (transcript) {
+                display_winner(scores, playerNumber);
+            }
+            send_game_over(players, playerNumber);
+            return 1;
         }
     }
-    send_score(fileOut, playerNumber, scores);
+    send_score(players, playerNumber, scores);
     if (*roundNo == deckNumber - 1) {
         *roundNo = 0;
     } else {
         (*roundNo)++;
     }
+    return 0;
 }
 
-int main(int argc, char *argv[]) {
-    signal(SIGPIPE, SIG_IGN);
-    char **decks = NULL;
-    int playerNumber = 2, deckNumber = 1, goalPoint = 0, roundNo = 0;
-    check_argu(argc, argv);
-    open_decks_file(argv, &deckNumber, &decks);
-    char playerHand[4][78];
+/*
+ * play one game to goalPoint with the players named in argv, dealing from
+ * deck roundNo on, and leave the final scores in scores
+ */
+void play_game(char *argv[], int playerNumber, int goalPoint,
+        unsigned char *decks, int deckNumber, int roundNo, int scores[4]) {
+    Hand playerHand[4];
     player_hand_init(playerHand);
-    FILE *fileIn[4];
-    FILE *fileOut[4];
+    Player players[4];
     int pid[4];
-    int scores[4] = {0, 0, 0, 0};
-
-    playerNumber = argc - 3;
-    goalPoint = atoi(argv[2]);
+    for (int i = 0; i < 4; i++) {
+        scores[i] = 0;
+    }
 
-    fork_players(playerNumber, pid, argv, fileIn, fileOut);
-    check_players_started(playerNumber, fileIn);
+    fork_players(playerNumber, pid, argv, players);
+    check_players_started(playerNumber, players);
 
     int currentPlayer = 0;
     while (1) {
         deal_cards(playerHand, playerNumber, decks, roundNo);
         display_hand(playerHand, playerNumber);
-        give_card_to_player(playerHand, playerNumber, fileOut);
+        give_card_to_player(playerHand, playerNumber, players);
         int trickNumberber = 52 / playerNumber;
         for (int trick = 0; trick < trickNumberber; trick++) {
             char playedCard[4][2];
-            lead_card(currentPlayer, fileOut, fileIn, playerHand, 
-                    playedCard, playerNumber);
+            lead_card(currentPlayer, players, playerHand, playedCard,
+                    playerNumber);
             char leadingSuit = playedCard[currentPlayer][1];
             next_player(&currentPlayer, playerNumber);
             for (int i = 1; i < playerNumber; i++) {
-                follow_card(currentPlayer, fileOut, fileIn,
-                        playerHand, playedCard, playerNumber, leadingSuit);
+                follow_card(currentPlayer, players, playerHand, playedCard,
+                        playerNumber, leadingSuit);
                 next_player(&currentPlayer, playerNumber);
             }
-            trick_over(fileOut, playerNumber);
+            trick_over(players, playerNumber);
             update_score(playedCard, playerNumber, leadingSuit,
                     &currentPlayer, scores);
         }
-        round_over(playerNumber, goalPoint, &roundNo, deckNumber,
-                scores, fileOut);
+        if (round_over(playerNumber, goalPoint, &roundNo, deckNumber,
+                scores, players)) {
+            break;
+        }
+    }
+    close_players(playerNumber, pid, players);
+}
+
+/*
+ * read CLUBHUB_GAMES=games[/workers]: the number of games of a tournament
+ * and the worker processes playing them (default one per online cpu).
+ * Both are at most 9 digits, so the results always fit in memory sizes.
+ * return 0 if it is not set
+ */
+int read_tournament(int *workers) {
+    char *value = getenv("CLUBHUB_GAMES");
+    if (value == NULL || strlen(value) == 0) {
+        return 0;
+    }
+    char *slash = strchr(value, '/');
+    int length = (slash != NULL) ? slash - value : strlen(value);
+    if (length == 0 || length > 9 ||
+            strspn(value, "0123456789") != length || atoi(value) <= 0) {
+        error(10);
+    }
+    *workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (slash != NULL) {
+        if (strlen(slash + 1) == 0 || strlen(slash + 1) > 9 ||
+                strspn(slash + 1, "0123456789") != strlen(slash + 1) ||
+                (*workers = atoi(slash + 1)) <= 0) {
+            error(10);
+        }
+    }
+    return atoi(value);
+}
+
+/* compare two scores for qsort */
+int compare_scores(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+/*
+ * print each player's wins (a shared lowest score is a win for each) and
+ * score distribution over the games in results, playerNumber scores each
+ */
+void display_tournament(char *argv[], int playerNumber, int *results,
+        int games) {
+    int *sorted = (int *)malloc(sizeof(int) * games);
+    for (int i = 0; i < playerNumber; i++) {
+        int wins = 0;
+        double sum = 0, squares = 0;
+        for (int game = 0; game < games; game++) {
+            int *scores = results + (size_t)game * 4;
+            int min = scores[0];
+            for (int j = 1; j < playerNumber; j++) {
+                if (scores[j] < min) {
+                    min = scores[j];
+                }
+            }
+            wins += (scores[i] == min);
+            sum += scores[i];
+            squares += (double)scores[i] * scores[i];
+            sorted[game] = scores[i];
+        }
+        qsort(sorted, games, sizeof(int), compare_scores);
+        double mean = sum / games;
+        /* rounding can leave equal scores a hair below zero variance */
+        double variance = squares / games - mean * mean;
+        printf("Player (%c) %s: wins %d (%.1f%%), score mean %.1f sd %.1f "
+                "min %d p25 %d median %d p75 %d max %d\n", 'A' + i,
+                argv[3 + i], wins, 100.0 * wins / games, mean,
+                sqrt((variance > 0) ? variance : 0), sorted[0],
+                sorted[games / 4], sorted[games / 2], sorted[games * 3 / 4],
+                sorted[games - 1]);
+    }
+    free(sorted);
+}
+
+/*
+ * play games with a pool of worker processes, each taking the next game
+ * until none are left, and print the results. Game g deals from deck g
+ * of the decks file on, wrapping around. A worker that fails ends the
+ * tournament with its exit status
+ */
+void play_tournament(char *argv[], int playerNumber, int goalPoint,
+        unsigned char *decks, int deckNumber, int games, int workers) {
+    /* the next game to play, then playerNumber scores per game */
+    int *shared = (int *)mmap(NULL, sizeof(int) * (1 + (size_t)games * 4),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        error(5);
+    }
+    transcript = 0;
+    fflush(stdout);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < workers; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            error(5);
+        } else if (pid == 0) {
+            int game;
+            while ((game = __sync_fetch_and_add(&shared[0], 1)) < games) {
+                play_game(argv, playerNumber, goalPoint, decks, deckNumber,
+                        game % deckNumber, shared + 1 + (size_t)game * 4);
+            }
+            exit(0);
+        }
+    }
+    int status, failed = 0;
+    while (wait(&status) > 0) {
+        if (!failed && (!WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+            failed = WIFEXITED(status) ? WEXITSTATUS(status) : 5;
+        }
+    }
+    if (failed) {
+        exit(failed);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = end.tv_sec - start.tv_sec +
+            (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Tournament: %d games, %d workers, %.3fs, %.1f games/s\n", games,
+            workers, seconds, games / seconds);
+    display_tournament(argv, playerNumber, shared + 1, games);
+}
+
+int main(int argc, char *argv[]) {
+    signal(SIGPIPE, SIG_IGN);
+    unsigned char *decks = NULL;
+    int playerNumber = 2, deckNumber = 1, goalPoint = 0, workers = 1;
+    check_argu(argc, argv);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    open_decks_file(argv, &deckNumber, &decks);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    int scores[4];
+
+    playerNumber = argc - 3;
+    goalPoint = atoi(argv[2]);
+
+    int games = read_tournament(&workers);
+    if (games > 0) {
+        double seconds = end.tv_sec - start.tv_sec +
+                (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("Decks: %d decks, %.3fs, %.0f decks/s\n", deckNumber,
+                seconds, deckNumber / seconds);
+        play_tournament(argv, playerNumber, goalPoint, decks, deckNumber,
+                games, workers);
+    } else {
+        play_game(argv, playerNumber, goalPoint, decks, deckNumber, 0,
+                scores);
     }
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,37 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+/*
+ * in-process player ABI. A player strategy built as a shared object
+ * (named *.so on the clubhub command line) exports ENGINE_SYMBOL, an Engine
+ * table, and clubhub calls it directly instead of running a process and
+ * talking to it over pipes. The calls stand for the messages of the text
+ * protocol, in the same order:
+ *
+ *   newround  hand as in "newround", e.g. "2S,TC,AH"
+ *   lead      "newtrick": write the card to lead, e.g. "TC", into card
+ *   follow    "yourturn": write the card to play into card
+ *   played    "played": the card just played, the player's own included
+ *   trickover "trickover"
+ *   scores    "scores": playerNumber totals, in player order
+ *   end       "end": the game is over, free the player
+ *
+ * "player" is what start returned for this player; a strategy must keep
+ * everything there, as all players of a game may share the object.
+ */
+#define ENGINE_SYMBOL "clubs_engine"
+#define ENGINE_VERSION 1
+
+typedef struct Engine {
+    int version;
+    void *(*start)(int playerNumber, char id);
+    void (*newround)(void *player, const char *hand);
+    void (*lead)(void *player, char card[3]);
+    void (*follow)(void *player, char card[3]);
+    void (*played)(void *player, const char *card);
+    void (*trickover)(void *player);
+    void (*scores)(void *player, const int *scores);
+    void (*end)(void *player);
+} Engine;
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+/*
+ * train capture file, written by station when STATION_CAPTURE is set and
+ * replayed by station-replay.
+ *
+ * The file starts with CAPTURE_MAGIC and one version byte. Records use the
+ * same layout as the event log: a type byte, a varint payload length and
+ * the payload, with varint integers and length prefixed strings.
+ */
+#define CAPTURE_MAGIC "STNCAP"
+#define CAPTURE_MAGIC_LEN 6
+#define CAPTURE_VERSION 1
+
+/* peer id, string: a peer's first captured train follows */
+#define CAPTURE_PEER 1
+/*
+ * peer id, nanoseconds since the previous train in the file, string:
+ * one train as received, without its newline
+ */
+#define CAPTURE_TRAIN 2
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef EVENTLOG_H
+#define EVENTLOG_H
+
+/*
+ * binary station event log, written by station when STATION_LOG=binary and
+ * read back by station-log.
+ *
+ * The file starts with EVENTLOG_MAGIC, one version byte and the station
+ * name. Every record after it is a type byte, a varint payload length and
+ * the payload, so readers can skip record types they do not know.
+ * Integers are LEB128 varints, signed values are zigzag encoded first and
+ * strings are a varint length followed by the bytes.
+ */
+#define EVENTLOG_MAGIC "STNLOG"
+#define EVENTLOG_MAGIC_LEN 6
+#define EVENTLOG_VERSION 1
+
+/* name id, string: give a resource name the next id */
+#define EVENT_NAME 1
+/* name id, signed quantity: a delta applied to a resource */
+#define EVENT_DELTA 2
+/* string: a station connected */
+#define EVENT_CONNECT 3
+/* string: a station disconnected */
+#define EVENT_DISCONNECT 4
+/*
+ * flags, then signed changes of processed, not mine, format err, no fwd and
+ * shed since the previous snapshot, then a count of (station, shed) pairs,
+ * then the signed change of duplicates if SNAPSHOT_DUPLICATE is set, then
+ * a count of (station, bytes held) pairs if SNAPSHOT_MEMORY is set.
+ * Each snapshot is one text dump of the log.
+ */
+#define EVENT_SNAPSHOT 5
+/*
+ * exit status, 1 for doomtrain and 2 for stopstation, written just before
+ * the final snapshot
+ */
+#define EVENT_EXIT 6
+
+/* snapshot flag: the text dump has a Shed: line */
+#define SNAPSHOT_SHED 1
+/* snapshot flag: the text dump has a Duplicate: line */
+#define SNAPSHOT_DUPLICATE 2
+/* snapshot flag: the text dump has a Memory: line */
+#define SNAPSHOT_MEMORY 4
+
+/* number of counters carried by a snapshot */
+#define SNAPSHOT_COUNTERS 5
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+/*
+ * binary train framing between stations, used on a connection when the
+ * dialing station sends FRAME_OFFER as a line of its own before the auth
+ * (STATION_FRAMING=binary). A build without framing takes the offer for a
+ * wrong auth and hangs up, and the dialing station then asks again in text.
+ *
+ * The auth and names are still exchanged as text lines. After that every
+ * train both ways is a frame: a varint payload length, then the payload.
+ * An empty frame is a keepalive. The payload is the train's ':' separated
+ * pieces in order, each one a segment: a kind byte, a varint content
+ * length and the content. The first segment is the station the train is
+ * for, always SEGMENT_TEXT.
+ * Integers are LEB128 varints, signed values are zigzag encoded first and
+ * strings are a varint length followed by the bytes.
+ */
+#define FRAME_OFFER "STNFRAME1"
+/* largest frame payload a station accepts */
+#define FRAME_MAX (64 * 1024 * 1024)
+
+/*
+ * bytes: a piece of the train as text. A multicast tree "[...]" and
+ * everything after it is sent as one text segment, ':' and all
+ */
+#define SEGMENT_TEXT 0
+/*
+ * pairs of a string name and a signed quantity: resource cargo such as
+ * "x+1,y-2", sent only when it turns back into exactly the same text
+ */
+#define SEGMENT_RESOURCES 1
+
+#endif
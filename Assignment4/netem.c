@@ -0,0 +1,395 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+
+/* largest piece of data sent at once, about one ethernet segment */
+#define SEGMENT 1448
+/* bytes a direction may hold before its reader stops reading */
+#define WINDOW (4 * 1024 * 1024)
+
+/* impairments applied to every link, all times in nanoseconds */
+typedef struct Config {
+    char *host;
+    char *port;
+    long delay;
+    long jitter;
+    double rate;
+    long stall;
+    double stallChance;
+} Config;
+
+/* a piece of data waiting in a direction until "release" */
+typedef struct Segment {
+    long release;
+    int length;
+    char *data;
+    struct Segment *next;
+} Segment;
+
+/*
+ * one direction of a proxied connection: a reader queues what arrives on
+ * "from" and a writer sends it on to "to" once it is due, no faster than
+ * the rate allows. A NULL data segment marks the end of the stream.
+ */
+typedef struct Direction {
+    int from;
+    int to;
+    Segment *head;
+    Segment *tail;
+    long bytes;
+    long lastRelease;
+    long linkFree;
+    int failed;
+    unsigned int jitterSeed;
+    unsigned int stallSeed;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    struct Link *link;
+} Direction;
+
+/* a proxied connection, freed by whichever direction finishes last */
+typedef struct Link {
+    Direction directions[2];
+    int finished;
+    pthread_mutex_t lock;
+} Link;
+
+/* the impairments given on the command line */
+Config config;
+
+/* takes in error code, then print stderr message and exit program */
+void error(int errorCode) {
+    switch (errorCode) {
+        case 1:
+            fprintf(stderr, "Usage: station-netem port port@host "\
+                    "[delay=ms] [jitter=ms] [rate=kB/s] "\
+                    "[stall=ms/percent]\n");
+            exit(1);
+            break;
+        case 2:
+            fprintf(stderr, "Invalid port\n");
+            exit(2);
+            break;
+        case 3:
+            fprintf(stderr, "Listen error\n");
+            exit(3);
+            break;
+        case 99:
+            fprintf(stderr, "Unspecified system call failure\n");
+            exit(8);
+            break;
+    }
+}
+
+/* return the monotonic clock in nanoseconds */
+long now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+/* turn a monotonic time in nanoseconds into a timespec */
+struct timespec to_timespec(long ns) {
+    struct timespec at = {ns / 1000000000L, ns % 1000000000L};
+    return at;
+}
+
+/*
+ * read a non-negative number from str into value, scaled by scale.
+ * return 0 if str is not a number, otherwise return 1
+ */
+int read_number(char *str, double scale, double *value) {
+    char *end;
+    if (*str == '\0' || *str == '-') {
+        return 0;
+    }
+    *value = strtod(str, &end) * scale;
+    return *end == '\0' && *value >= 0;
+}
+
+/* read the target and the impairment options into config */
+void read_config(int argc, char *argv[]) {
+    char *at = strchr(argv[2], '@');
+    if (at == NULL || at == argv[2] || *(at + 1) == '\0') {
+        error(1);
+    }
+    *at = '\0';
+    config.port = argv[2];
+    config.host = at + 1;
+    if (strspn(config.port, "0123456789") != strlen(config.port)) {
+        error(2);
+    }
+    for (int i = 3; i < argc; i++) {
+        double value, chance;
+        char *slash;
+        if (strncmp(argv[i], "delay=", 6) == 0 &&
+                read_number(argv[i] + 6, 1e6, &value)) {
+            config.delay = value;
+        } else if (strncmp(argv[i], "jitter=", 7) == 0 &&
+                read_number(argv[i] + 7, 1e6, &value)) {
+            config.jitter = value;
+        } else if (strncmp(argv[i], "rate=", 5) == 0 &&
+                read_number(argv[i] + 5, 1000, &value) && value > 0) {
+            config.rate = value;
+        } else if (strncmp(argv[i], "stall=", 6) == 0 &&
+                (slash = strchr(argv[i], '/')) != NULL) {
+            *slash = '\0';
+            if (!read_number(argv[i] + 6, 1e6, &value) ||
+                    !read_number(slash + 1, 0.01, &chance) || chance > 1) {
+                error(1);
+            }
+            config.stall = value;
+            config.stallChance = chance;
+        } else {
+            error(1);
+        }
+    }
+}
+
+/*
+ * queue length bytes of data, or the end of the stream if data is NULL,
+ * waiting while the direction already holds a full window
+ */
+void queue_segment(Direction *direction, char *data, int length) {
+    Segment *segment = (Segment *)malloc(sizeof(Segment));
+    if (segment == NULL) {
+        error(99);
+    }
+    segment->data = NULL;
+    if (data != NULL) {
+        if ((segment->data = (char *)malloc(length)) == NULL) {
+            error(99);
+        }
+        memcpy(segment->data, data, length);
+    }
+    segment->length = length;
+    segment->next = NULL;
+    /* jitter never reorders a stream, as TCP would not either */
+    long release = now_ns() + config.delay;
+    if (config.jitter > 0) {
+        release += (long)((rand_r(&direction->jitterSeed) /
+                (double)RAND_MAX * 2 - 1) * config.jitter);
+    }
+    pthread_mutex_lock(&direction->lock);
+    while (direction->bytes >= WINDOW) {
+        pthread_cond_wait(&direction->changed, &direction->lock);
+    }
+    if (release < direction->lastRelease) {
+        release = direction->lastRelease;
+    }
+    segment->release = direction->lastRelease = release;
+    if (direction->tail == NULL) {
+        direction->head = segment;
+    } else {
+        direction->tail->next = segment;
+    }
+    direction->tail = segment;
+    direction->bytes += length;
+    pthread_cond_broadcast(&direction->changed);
+    pthread_mutex_unlock(&direction->lock);
+}
+
+/* read everything arriving on the direction's source into its queue */
+void *reader_thread(void *arg) {
+    Direction *direction = (Direction *)arg;
+    char buffer[SEGMENT];
+    int length;
+    while ((length = read(direction->from, buffer, SEGMENT)) > 0) {
+        queue_segment(direction, buffer, length);
+    }
+    queue_segment(direction, NULL, 0);
+    return NULL;
+}
+
+/*
+ * send a segment once it is due and the link is free, holding it for the
+ * stall time if it is unlucky, like a lost packet waiting for its
+ * retransmission. Once a write fails the rest of the stream is dropped
+ */
+void send_segment(Direction *direction, Segment *segment) {
+    if (direction->failed) {
+        return;
+    }
+    long send = segment->release;
+    if (send < direction->linkFree) {
+        send = direction->linkFree;
+    }
+    if (config.stall > 0 &&
+            rand_r(&direction->stallSeed) / (double)RAND_MAX <
+            config.stallChance) {
+        send += config.stall;
+    }
+    struct timespec at = to_timespec(send);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL) != 0) {
+    }
+    direction->linkFree = send;
+    if (config.rate > 0) {
+        direction->linkFree += (long)(segment->length / config.rate * 1e9);
+    }
+    int sent = 0;
+    while (sent < segment->length) {
+        int length = write(direction->to, segment->data + sent,
+                segment->length - sent);
+        if (length <= 0) {
+            /* stop the reader too, it ends the stream once it sees that */
+            direction->failed = 1;
+            shutdown(direction->from, SHUT_RD);
+            return;
+        }
+        sent += length;
+    }
+}
+
+/*
+ * send a direction's queue on until its stream ends, then pass the end on.
+ * The direction that finishes last closes and frees the link
+ */
+void *writer_thread(void *arg) {
+    Direction *direction = (Direction *)arg;
+    Link *link = direction->link;
+    while (1) {
+        pthread_mutex_lock(&direction->lock);
+        while (direction->head == NULL) {
+            pthread_cond_wait(&direction->changed, &direction->lock);
+        }
+        Segment *segment = direction->head;
+        pthread_mutex_unlock(&direction->lock);
+        if (segment->data == NULL) {
+            free(segment);
+            break;
+        }
+        send_segment(direction, segment);
+        pthread_mutex_lock(&direction->lock);
+        direction->head = segment->next;
+        if (direction->head == NULL) {
+            direction->tail = NULL;
+        }
+        direction->bytes -= segment->length;
+        pthread_cond_broadcast(&direction->changed);
+        pthread_mutex_unlock(&direction->lock);
+        free(segment->data);
+        free(segment);
+    }
+    shutdown(direction->to, SHUT_WR);
+    pthread_mutex_lock(&link->lock);
+    int last = ++link->finished == 2;
+    pthread_mutex_unlock(&link->lock);
+    if (!last) {
+        return NULL;
+    }
+    close(link->directions[0].from);
+    close(link->directions[1].from);
+    free(link);
+    return NULL;
+}
+
+/* connect to the target station, return the socket or -1 if it fails */
+int connect_target(void) {
+    struct addrinfo hints, *result;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(config.host, config.port, &hints, &result) != 0) {
+        return -1;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, result->ai_addr, result->ai_addrlen) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+    return fd;
+}
+
+/* start a reader and a writer thread for both directions of a link */
+void start_link(int client, int target) {
+    Link *link = (Link *)calloc(1, sizeof(Link));
+    if (link == NULL) {
+        error(99);
+    }
+    int one = 1;
+    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(target, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    pthread_mutex_init(&link->lock, NULL);
+    for (int i = 0; i < 2; i++) {
+        Direction *direction = &link->directions[i];
+        direction->from = (i == 0) ? client : target;
+        direction->to = (i == 0) ? target : client;
+        direction->jitterSeed = (unsigned int)now_ns() + i;
+        direction->stallSeed = direction->jitterSeed * 2654435761U;
+        direction->link = link;
+        pthread_mutex_init(&direction->lock, NULL);
+        pthread_cond_init(&direction->changed, NULL);
+    }
+    for (int i = 0; i < 2; i++) {
+        pthread_t threadId;
+        if (pthread_create(&threadId, NULL, reader_thread,
+                &link->directions[i]) != 0) {
+            error(99);
+        }
+        pthread_detach(threadId);
+        if (pthread_create(&threadId, NULL, writer_thread,
+                &link->directions[i]) != 0) {
+            error(99);
+        }
+        pthread_detach(threadId);
+    }
+}
+
+/* listen on port, 0 for any, and print the port number on stdout */
+int open_listen(char *port) {
+    if (strspn(port, "0123456789") != strlen(port) || strlen(port) == 0) {
+        error(2);
+    }
+    struct sockaddr_in address;
+    socklen_t size = sizeof(address);
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(atoi(port));
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    int fd = socket(AF_INET, SOCK_STREAM, 0), one = 1;
+    if (fd < 0) {
+        error(3);
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+            listen(fd, SOMAXCONN) < 0 ||
+            getsockname(fd, (struct sockaddr *)&address, &size) < 0) {
+        error(3);
+    }
+    printf("%d\n", ntohs(address.sin_port));
+    fflush(stdout);
+    return fd;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        error(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    read_config(argc, argv);
+    int fdServer = open_listen(argv[1]);
+    while (1) {
+        int client = accept(fdServer, NULL, NULL);
+        if (client < 0) {
+            continue;
+        }
+        int target = connect_target();
+        if (target < 0) {
+            close(client);
+            continue;
+        }
+        start_link(client, target);
+    }
+    return 0;
+}
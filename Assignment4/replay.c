@@ -0,0 +1,328 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include "capture.h"
+
+/* one captured train, "time" is nanoseconds since the capture started */
+typedef struct Train {
+    long time;
+    char *text;
+} Train;
+
+/* a captured peer and the trains it sent, in the order they arrived */
+typedef struct Peer {
+    char *name;
+    Train *trains;
+    int trainNumber;
+    int trainSize;
+    int fd;
+    FILE *writeF;
+    struct Replay *replay;
+} Peer;
+
+/*
+ * the whole capture and how to replay it. A peer that connected more than
+ * once, or stayed connected over a live upgrade, has several capture ids,
+ * "ids" maps each of them to the one peer
+ */
+typedef struct Replay {
+    Peer *peers;
+    int peerNumber;
+    int peerSize;
+    int *ids;
+    int idNumber;
+    int idSize;
+    long trainNumber;
+    char *auth;
+    double speed;
+    struct timespec start;
+} Replay;
+
+/* takes in error code, then print stderr message and exit program */
+void error(int errorCode) {
+    switch (errorCode) {
+        case 1:
+            fprintf(stderr, "Usage: station-replay capturefile authfile "\
+                    "port [host [speed|max]]\n");
+            exit(1);
+            break;
+        case 2:
+            fprintf(stderr, "Unable to open capture\n");
+            exit(2);
+            break;
+        case 3:
+            fprintf(stderr, "Invalid capture\n");
+            exit(3);
+            break;
+        case 4:
+            fprintf(stderr, "Invalid name/auth\n");
+            exit(4);
+            break;
+        case 5:
+            fprintf(stderr, "Unable to connect to station\n");
+            exit(5);
+            break;
+        case 99:
+            fprintf(stderr, "Unspecified system call failure\n");
+            exit(8);
+            break;
+    }
+}
+
+/* read a varint from the file, exit on a truncated capture */
+unsigned long file_varint(FILE *captureFile) {
+    unsigned long value = 0;
+    int shift = 0, ch;
+    do {
+        if ((ch = fgetc(captureFile)) == EOF || shift > 63) {
+            error(3);
+        }
+        value |= (unsigned long)(ch & 0x7f) << shift;
+        shift += 7;
+    } while (ch & 0x80);
+    return value;
+}
+
+/* read a length prefixed string from the file into a new buffer */
+char *file_string(FILE *captureFile) {
+    unsigned long length = file_varint(captureFile);
+    char *str = (char *)malloc(sizeof(char) * (length + 1));
+    if (str == NULL) {
+        error(99);
+    }
+    if (fread(str, 1, length, captureFile) != length) {
+        error(3);
+    }
+    str[length] = '\0';
+    return str;
+}
+
+/* add one train to the end of peer's train list */
+void add_train(Peer *peer, long time, char *text) {
+    if (peer->trainNumber == peer->trainSize) {
+        peer->trainSize = (peer->trainSize == 0) ? 64 : peer->trainSize * 2;
+        peer->trains = (Train *)realloc(peer->trains,
+                sizeof(Train) * peer->trainSize);
+        if (peer->trains == NULL) {
+            error(99);
+        }
+    }
+    peer->trains[peer->trainNumber].time = time;
+    peer->trains[peer->trainNumber].text = text;
+    peer->trainNumber++;
+}
+
+/*
+ * return the index of the peer called name, adding it if the capture has
+ * not named it before. name is kept or freed
+ */
+int find_peer(Replay *replay, char *name) {
+    for (int i = 0; i < replay->peerNumber; i++) {
+        if (strcmp(replay->peers[i].name, name) == 0) {
+            free(name);
+            return i;
+        }
+    }
+    if (replay->peerNumber == replay->peerSize) {
+        replay->peerSize = (replay->peerSize == 0) ? 16 :
+                replay->peerSize * 2;
+        replay->peers = (Peer *)realloc(replay->peers,
+                sizeof(Peer) * replay->peerSize);
+        if (replay->peers == NULL) {
+            error(99);
+        }
+    }
+    memset(&replay->peers[replay->peerNumber], 0, sizeof(Peer));
+    replay->peers[replay->peerNumber].name = name;
+    return replay->peerNumber++;
+}
+
+/* read every peer and train of the capture file into replay */
+void read_capture(char *path, Replay *replay) {
+    FILE *captureFile = fopen(path, "rb");
+    char magic[CAPTURE_MAGIC_LEN];
+    long time = 0;
+    int type;
+    if (captureFile == NULL) {
+        error(2);
+    }
+    if (fread(magic, 1, CAPTURE_MAGIC_LEN, captureFile) != CAPTURE_MAGIC_LEN
+            || memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != 0 ||
+            fgetc(captureFile) != CAPTURE_VERSION) {
+        error(3);
+    }
+    while ((type = fgetc(captureFile)) != EOF) {
+        unsigned long length = file_varint(captureFile);
+        long end = ftell(captureFile) + length;
+        if (type == CAPTURE_PEER) {
+            unsigned long id = file_varint(captureFile);
+            if (id != replay->idNumber) {
+                error(3);
+            }
+            if (replay->idNumber == replay->idSize) {
+                replay->idSize = (replay->idSize == 0) ? 16 :
+                        replay->idSize * 2;
+                replay->ids = (int *)realloc(replay->ids,
+                        sizeof(int) * replay->idSize);
+                if (replay->ids == NULL) {
+                    error(99);
+                }
+            }
+            replay->ids[id] = find_peer(replay, file_string(captureFile));
+            replay->idNumber++;
+        } else if (type == CAPTURE_TRAIN) {
+            unsigned long id = file_varint(captureFile);
+            if (id >= replay->idNumber) {
+                error(3);
+            }
+            long delta = file_varint(captureFile);
+            time = (replay->trainNumber == 0) ? 0 : time + delta;
+            add_train(&replay->peers[replay->ids[id]], time,
+                    file_string(captureFile));
+            replay->trainNumber++;
+        }
+        if (fseek(captureFile, end, SEEK_SET) != 0) {
+            error(3);
+        }
+    }
+    fclose(captureFile);
+}
+
+/* read the auth string from the first line of the auth file */
+char *read_auth_file(char *path) {
+    FILE *authFile = fopen(path, "r");
+    char *auth = NULL;
+    size_t size = 0;
+    if (authFile == NULL || getline(&auth, &size, authFile) <= 0) {
+        error(4);
+    }
+    auth[strcspn(auth, "\r\n")] = '\0';
+    if (strlen(auth) == 0) {
+        error(4);
+    }
+    fclose(authFile);
+    return auth;
+}
+
+/*
+ * connect to the station as peer and do the auth/name handshake,
+ * exit if the station cannot be reached
+ */
+void connect_peer(Peer *peer, char *host, char *port) {
+    struct addrinfo hints, *result;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &result) != 0) {
+        error(5);
+    }
+    if ((peer->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+            connect(peer->fd, result->ai_addr, result->ai_addrlen) < 0) {
+        error(5);
+    }
+    freeaddrinfo(result);
+    peer->writeF = fdopen(peer->fd, "w");
+    fprintf(peer->writeF, "%s\n%s\n", peer->replay->auth, peer->name);
+    fflush(peer->writeF);
+    char ch = '\0';
+    while (ch != '\n') {
+        if (read(peer->fd, &ch, 1) != 1) {
+            error(5);
+        }
+    }
+}
+
+/* discard whatever the station forwards back to a replayed peer */
+void *drain_thread(void *arg) {
+    Peer *peer = (Peer *)arg;
+    char buffer[4096];
+    while (read(peer->fd, buffer, sizeof(buffer)) > 0) {
+    }
+    return NULL;
+}
+
+/*
+ * send a peer's trains in captured order, each one at its captured time
+ * divided by the speed, or back to back if the speed is 0
+ */
+void *peer_thread(void *arg) {
+    Peer *peer = (Peer *)arg;
+    Replay *replay = peer->replay;
+    for (int i = 0; i < peer->trainNumber; i++) {
+        if (replay->speed > 0) {
+            long wait = (long)(peer->trains[i].time / replay->speed);
+            struct timespec at = replay->start;
+            at.tv_sec += wait / 1000000000L;
+            at.tv_nsec += wait % 1000000000L;
+            if (at.tv_nsec >= 1000000000L) {
+                at.tv_sec++;
+                at.tv_nsec -= 1000000000L;
+            }
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL);
+        }
+        fprintf(peer->writeF, "%s\n", peer->trains[i].text);
+        if (replay->speed > 0) {
+            fflush(peer->writeF);
+        }
+    }
+    fflush(peer->writeF);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 4 || argc > 6) {
+        error(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    Replay replay;
+    memset(&replay, 0, sizeof(Replay));
+    replay.speed = 1;
+    if (argc == 6) {
+        char *end;
+        replay.speed = (strcmp(argv[5], "max") == 0) ? 0 :
+                strtod(argv[5], &end);
+        if (strcmp(argv[5], "max") != 0 && (*end != '\0' ||
+                replay.speed <= 0)) {
+            error(1);
+        }
+    }
+    read_capture(argv[1], &replay);
+    replay.auth = read_auth_file(argv[2]);
+    char *host = (argc >= 5) ? argv[4] : "localhost";
+    for (int i = 0; i < replay.peerNumber; i++) {
+        pthread_t threadId;
+        replay.peers[i].replay = &replay;
+        connect_peer(&replay.peers[i], host, argv[3]);
+        pthread_create(&threadId, NULL, drain_thread, &replay.peers[i]);
+        pthread_detach(threadId);
+    }
+    pthread_t *threadIds = (pthread_t *)malloc(sizeof(pthread_t) *
+            (replay.peerNumber + 1));
+    clock_gettime(CLOCK_MONOTONIC, &replay.start);
+    for (int i = 0; i < replay.peerNumber; i++) {
+        if (pthread_create(&threadIds[i], NULL, peer_thread,
+                &replay.peers[i]) != 0) {
+            error(99);
+        }
+    }
+    for (int i = 0; i < replay.peerNumber; i++) {
+        pthread_join(threadIds[i], NULL);
+    }
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - replay.start.tv_sec) +
+            (end.tv_nsec - replay.start.tv_nsec) / 1e9;
+    printf("%ld trains from %d peers in %.3fs (%.0f trains/s)\n",
+            replay.trainNumber, replay.peerNumber, elapsed,
+            (elapsed > 0) ? replay.trainNumber / elapsed : 0);
+    return 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
@@ -11,6 +12,187 @@
 #include <netdb.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <spawn.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <sched.h>
+#include <dirent.h>
+#include <sys/uio.h>
+#include "eventlog.h"
+#include "capture.h"
+#include "frame.h"
+#ifdef STATION_USDT
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#endif
+
+/* timer wheel geometry: 4 levels of 64 slots, 64^4 ticks in total */
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+/* length of one timer wheel tick in milliseconds */
+#define WHEEL_TICK 10
+/* time buckets the train ID dedup window is spread over */
+#define DEDUP_GENERATIONS 4
+/* train ID hashes per dedup bucket, 4 x 8 bytes is half a cache line */
+#define DEDUP_SLOTS 4
+/* bits set per train ID in a generation's Bloom filter block */
+#define DEDUP_HASHES 6
+/* pieces of train a peer's outbox holds before it must be sent */
+#define OUTBOX_PARTS 256
+/* bytes an outbox copies for trains not in the reader's buffer */
+#define OUTBOX_COPY 16384
+/* bytes an outbox holds with STATION_BATCH unless it says otherwise */
+#define BATCH_BYTES 65536
+/* bytes of a peer name kept in a trace entry, with its terminator */
+#define TRACE_NAME 24
+/* bytes of a connection arena block unless STATION_ARENA says otherwise */
+#define ARENA_BLOCK 1024
+
+/*
+ * tracepoints: receive (a train taken from a peer), parse (its cargo read),
+ * apply (resources loaded), forward (sent on to a peer), connect and
+ * disconnect. Each carries a KIND_, a peer name and a size: bytes of the
+ * train, resources applied, or for connect and disconnect the socket and
+ * the bytes left unread. Built with USDT=1 they are also USDT probes
+ * "station:point" for perf, bpftrace or systemtap.
+ */
+/* kinds of train, and of connection for connect and disconnect */
+#define KIND_TEXT 0
+#define KIND_FRAME 1
+#define KIND_RESOURCE 2
+#define KIND_OWN 3
+#define KIND_ADD 4
+#define KIND_DOOM 5
+#define KIND_STOP 6
+#define KIND_QUERY 7
+#define KIND_GET 8
+#define KIND_ROUTE 9
+#define KIND_RING 10
+#define KIND_INVALID 11
+#define KIND_ACCEPTED 12
+#define KIND_DIALED 13
+#define KIND_TENANT 14
+
+#ifdef STATION_USDT
+#define TRACE_ON(point) (station_##point##_semaphore || traceRing.mask)
+#define TRACE_PROBE(point, kind, peer, size) \
+        DTRACE_PROBE3(station, point, kind, peer, size)
+#else
+#define TRACE_ON(point) (traceRing.mask)
+#define TRACE_PROBE(point, kind, peer, size)
+#endif
+/*
+ * fire tracepoint point. Its arguments are only worked out while a tracer
+ * is attached or STATION_TRACE is set, otherwise it costs one test
+ */
+#define TRACE(point, kind, peer, size) \
+        do { \
+            if (__builtin_expect(TRACE_ON(point), 0)) { \
+                int traceKind = (kind); \
+                const char *tracePeer = (peer); \
+                long traceSize = (size); \
+                TRACE_PROBE(point, traceKind, tracePeer, traceSize); \
+                trace_record(#point, traceKind, tracePeer, traceSize); \
+            } \
+        } while (0)
+
+/*
+ * a timer in the wheel. "fire" is called from the timer thread with the
+ * wheel locked, so it must not block and cancel_timer() must not be called
+ * from it.
+ */
+typedef struct Timer {
+    unsigned long expires;
+    void (*fire)(struct Timer *);
+    void *owner;
+    int armed;
+    struct Timer *prev;
+    struct Timer *next;
+} Timer;
+
+/* hierarchical timer wheel, slots are circular lists with sentinel heads */
+typedef struct Wheel {
+    Timer slots[WHEEL_LEVELS][WHEEL_SIZE];
+    unsigned long now;
+    sem_t lock;
+} Wheel;
+
+/* a block of an arena, with "size" bytes of data of which "used" are taken */
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaBlock;
+
+/*
+ * memory one connection owns, all given back when it goes. "kept" blocks
+ * hold what lasts as long as the connection, its name and read buffer;
+ * "scratch" blocks hold what a train needs while it is processed and are
+ * emptied after each train. "held" counts the bytes of both lists
+ */
+typedef struct Arena {
+    ArenaBlock *kept;
+    ArenaBlock *scratch;
+    long held;
+} Arena;
+
+/*
+ * buffered reader over a peer socket, its buffer taken from the arena.
+ * Lines are split in place and stay valid until the next read; bytes from
+ * "start" to "end" are unconsumed.
+ */
+typedef struct Reader {
+    int fd;
+    struct Arena arena;
+    char *data;
+    int start;
+    int end;
+    int size;
+    int last;
+    int *stop;
+} Reader;
+
+/* a binary log record being built before it is written out */
+typedef struct Record {
+    unsigned char *data;
+    int length;
+    int size;
+} Record;
+
+/*
+ * one time bucket of the dedup cache: a blocked Bloom filter, one 64 byte
+ * block per train ID, in front of an open addressed table of 64 bit train
+ * ID hashes (0 marks an empty slot) that is only probed on a filter hit
+ */
+typedef struct Generation {
+    uint64_t (*filter)[8];
+    uint64_t (*buckets)[DEDUP_SLOTS];
+    unsigned long started;
+    int count;
+} Generation;
+
+/*
+ * train IDs seen recently. New IDs go into the current generation, which
+ * moves on to the oldest one (clearing it) every "period" ticks or once
+ * "capacity" IDs are in it, so an ID is remembered for at least
+ * (DEDUP_GENERATIONS - 1) periods unless the cache overflows.
+ */
+typedef struct Dedup {
+    Generation generations[DEDUP_GENERATIONS];
+    int current;
+    int blockNumber;
+    int bucketNumber;
+    int capacity;
+    unsigned long period;
+} Dedup;
 
 typedef struct Station {
     char *name;
@@ -22,37 +204,334 @@ typedef struct Station {
     int notMine;
     int formatErr;
     int noFwd;
+    int shed;
+    struct RateLimit *rateLimit;
+    FILE *logFp;
+    int logBinary;
+    int logNames;
+    int logged[SNAPSHOT_COUNTERS];
+    struct Record record;
+    FILE *captureFp;
+    int capturePeers;
+    struct timespec captureLast;
+    unsigned long idleTicks;
+    unsigned long keepaliveTicks;
+    unsigned long handshakeTicks;
+    int upgrading;
+    int readers;
+    int parked;
+    struct Route *routes;
+    struct Route **routeIndex;
+    int routeIndexSize;
+    int routeCount;
+    struct Dedup *dedup;
+    int duplicate;
+    int loggedDuplicate;
+    struct Query *queries;
+    unsigned long queryTicks;
+    unsigned long queryNumber;
+    struct Resource **index;
+    int indexSize;
+    int indexCount;
+    struct Ring *ring;
+    int stopped;
+    int framing;
+    int peered;
 } Station;
 
 typedef struct Connected {
     char *name;
     int fd;
+    int shed;
+    int ring;
+    int framing;
+    int dialed;
+    struct Outbox *outbox;
+    struct Threadinfo *info;
+    struct Connected *peer;
     struct Connected *next;
 } Connected;
 
 typedef struct Resource {
     char *name;
     int quantity;
+    int logId;
     struct Resource *next;
+    struct Resource *chain;
 } Resource;
 
+/* a registered route template: the hop after this station, NULL at the end */
+typedef struct Route {
+    char *name;
+    char *hop;
+    struct Route *next;
+    struct Route *chain;
+} Route;
+
+/*
+ * a network-wide sum query this station takes part in. "reply" is the
+ * station to answer, or the peer that asked if "origin" is set; "waiting"
+ * counts unanswered neighbours and is -1 once this station has answered.
+ */
+typedef struct Query {
+    char *id;
+    char *target;
+    char *reply;
+    int origin;
+    long sum;
+    long resources;
+    long stations;
+    long depth;
+    int partial;
+    int expired;
+    int waiting;
+    unsigned long finished;
+    struct Station *station;
+    struct Connected *connected;
+    Timer deadline;
+    struct Query *next;
+} Query;
+
+/* a point on the consistent-hash ring, owned by ring member "member" */
+typedef struct RingPoint {
+    uint64_t hash;
+    int member;
+} RingPoint;
+
+/*
+ * consistent-hash ring partitioning resource names over this station
+ * (member 0) and every connected station that sent ring(), with "points"
+ * points each. "batches" collects the cargo bound for each member while
+ * a train is processed.
+ */
+typedef struct Ring {
+    int points;
+    char **members;
+    int memberNumber;
+    RingPoint *circle;
+    int pointNumber;
+    FILE **batches;
+    char **texts;
+    size_t *sizes;
+} Ring;
+
+/* configured admission rate for one peer name, "*" is the default entry */
+typedef struct RateLimit {
+    char *name;
+    double rate;
+    double burst;
+    struct RateLimit *next;
+} RateLimit;
+
+/* token bucket owned by a single reader thread, so it needs no lock */
+typedef struct Bucket {
+    double tokens;
+    double rate;
+    double burst;
+    struct timespec last;
+} Bucket;
+
+/* peers listed in the topology file, shared by the bootstrap workers */
+typedef struct Bootstrap {
+    char **hosts;
+    int *ports;
+    int count;
+    int next;
+    int parallel;
+    int retries;
+    int failed;
+    struct Station *station;
+    struct Connected *connected;
+    struct Resource *resource;
+} Bootstrap;
+
 typedef struct Threadinfo {
     int fd;
-    FILE *fp;
+    struct Reader reader;
     char *name;
     struct Station *station;
     struct Connected *connected;
     struct Resource *resource;
+    struct Connected *self;
+    struct Bucket bucket;
+    int captureId;
+    struct Record capture;
+    unsigned long lastSeen;
+    struct Timer idleTimer;
+    struct Timer keepaliveTimer;
+    int keepaliveDue;
+    pthread_t thread;
+    char *trainId;
 } Threadinfo;
 
+/* a station hosted by this process, the first is the one named in argv */
+typedef struct Tenant {
+    struct Station *station;
+    struct Connected *connected;
+    struct Resource *resource;
+    struct Tenant *next;
+} Tenant;
+
+/* a train one tenant sent another, waiting for whoever holds sem */
+typedef struct Pending {
+    struct Threadinfo *info;
+    char *line;
+    struct Pending *next;
+} Pending;
+
+/*
+ * where threads run, see STATION_CPUS: service threads stay on "service" and
+ * each reader takes the next cpu of "readers" in turn
+ */
+typedef struct Placement {
+    int pinned;
+    cpu_set_t service;
+    cpu_set_t readers;
+    int next;
+} Placement;
+
+/* what the upgrade thread needs to hand the station over */
+typedef struct Upgrade {
+    struct Station *station;
+    struct Connected *connected;
+    struct Resource *resource;
+    int fdServer;
+    pthread_t acceptor;
+    char **argv;
+} Upgrade;
+
+/* a received handoff message being decoded */
+typedef struct Cursor {
+    unsigned char *data;
+    int length;
+    int position;
+} Cursor;
+
+/* one segment of a received frame, "start" is where its kind byte sits */
+typedef struct Segment {
+    int kind;
+    unsigned char *data;
+    int length;
+    int start;
+} Segment;
+
+/*
+ * trains queued for a peer socket while a reader works through what it has
+ * buffered, sent with one writev when it is done. Parts point into the
+ * reader's buffer where they can; anything else is copied into "copied".
+ */
+typedef struct Outbox {
+    struct iovec parts[OUTBOX_PARTS];
+    int count;
+    char *copied;
+    int used;
+    long since;
+    int queued;
+    struct Connected *nextQueued;
+} Outbox;
+
+/*
+ * one tracepoint hit. "sequence" is 0 while the entry is being written,
+ * then its position in the trace plus one
+ */
+typedef struct TraceEntry {
+    unsigned long sequence;
+    long time;
+    long size;
+    const char *point;
+    int kind;
+    char peer[TRACE_NAME];
+} TraceEntry;
+
+/*
+ * the last "mask" + 1 tracepoint hits, see STATION_TRACE. Threads claim
+ * entries with an atomic add on "next", so recording takes no lock;
+ * "dumped" is the position the last dump got to
+ */
+typedef struct TraceRing {
+    TraceEntry *entries;
+    unsigned long mask;
+    unsigned long next;
+    unsigned long dumped;
+    long started;
+    char *path;
+} TraceRing;
+
+/*
+ * write coalescing, see STATION_BATCH. With a delay every queued train is
+ * copied, and an outbox is sent once its oldest train is "delay"
+ * nanoseconds old or it holds "bytes" bytes. "waiting" is set, under sem,
+ * while the batch thread has nothing to wait for but "wake"
+ */
+typedef struct Batch {
+    long delay;
+    int bytes;
+    int waiting;
+    sem_t wake;
+} Batch;
+
 /* global variable for semaphore*/
 sem_t sem;
+/* semaphore for the capture file, so capturing never waits on sem */
+sem_t captureSem;
+/* timer wheel for idle timeouts, handshake deadlines and keepalives */
+Wheel wheel;
+/* posted by the SIGUSR2 handler to start a live upgrade */
+sem_t upgradeSem;
+/* posted by keepalive timers, set while a post is not yet taken */
+sem_t keepaliveSem;
+int keepalivePosted;
+/* posted by query deadlines, set while a post is not yet taken */
+sem_t querySem;
+int queryPosted;
+/* posted by the SIGHUP handler to dump the logs */
+sem_t dumpSem;
+/* reader threads wait here while an upgrade is in progress */
+sem_t parkSem;
+/*
+ * SIGUSR1 is blocked everywhere and only let through while a reader waits
+ * for input, so it can wake readers without ever interrupting a write
+ */
+sigset_t wakeMask;
+/* every station this process hosts, see STATION_TENANTS */
+Tenant *tenants;
+/* trains between co-hosted tenants, delivered in order under sem */
+Pending *pending;
+Pending *pendingTail;
+/* peers with trains in their outbox, sent before sem is let go */
+Connected *queuedPeers;
+/* write coalescing, off unless STATION_BATCH is set */
+Batch batch = {0, OUTBOX_COPY, 0};
+/* tracepoint hits, not kept unless STATION_TRACE is set */
+TraceRing traceRing;
+/* names of the KIND_ values in a trace dump */
+const char *kindNames[] = {"text", "frame", "resource", "own", "add",
+        "doomtrain", "stopstation", "query", "get", "route", "ring",
+        "invalid", "accepted", "dialed", "tenant"};
+#ifdef STATION_USDT
+/* set by a tracer attached to the probe, see sys/sdt.h */
+volatile unsigned short station_receive_semaphore
+        __attribute__((section(".probes")));
+volatile unsigned short station_parse_semaphore
+        __attribute__((section(".probes")));
+volatile unsigned short station_apply_semaphore
+        __attribute__((section(".probes")));
+volatile unsigned short station_forward_semaphore
+        __attribute__((section(".probes")));
+volatile unsigned short station_connect_semaphore
+        __attribute__((section(".probes")));
+volatile unsigned short station_disconnect_semaphore
+        __attribute__((section(".probes")));
+#endif
+/* thread placement, all unpinned unless STATION_CPUS is set */
+Placement placement;
+/* connection arena block size and whether dumps show them, STATION_ARENA */
+size_t arenaBlock = ARENA_BLOCK;
+int arenaLogged;
+/* the arena of the connection the calling thread reads, NULL elsewhere */
+__thread Arena *scratch;
 /* pointer of station information to pass in signal handler */
 Station *sigStation;
-/* pointer of connected station information to pass in signal handler */
-Connected *sigConnected;
-/* pointer of resource information to pass in signal handler */
-Resource *sigResource;
 
 /* takes in error code, then print stderr message and exit program */
 void error(int errorCode) {
@@ -86,6 +565,10 @@ void error(int errorCode) {
             fprintf(stderr, "Duplicate station names\n");
             exit(7);
             break;
+        case 9:
+            fprintf(stderr, "Invalid configuration\n");
+            exit(9);
+            break;
         case 99:
             fprintf(stderr, "Unspecified system call failure\n");
             exit(8);
@@ -97,851 +580,4760 @@ void error(int errorCode) {
 }
 
 /*
- * use a dynamic buffer to read one line from given file pointer
- * return a char pointer for that line
+ * atomically increase a station counter, used for counters that are touched
+ * by reader threads before they take the semaphore
  */
-char *read_line(FILE *readF) {
-    char ch;
-    int len = 1;
-    char *buffer = (char*)malloc(sizeof(char) * len);
-    int i = 0;
-    while (((ch = fgetc(readF)) != EOF) && (ch != '\n')) {
-        buffer[i] = ch;
-        i++;
-        if (i == len) {
-            len *= 2;
-            buffer = (char*)realloc(buffer, sizeof(char) * len);
-        }
+void count(int *counter) {
+    __sync_fetch_and_add(counter, 1);
+}
+
+/* put timer into the wheel slot for its expiry tick, wheel must be locked */
+void wheel_insert(Timer *timer) {
+    unsigned long delta = timer->expires - wheel.now;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 &&
+            delta >= (1UL << (WHEEL_BITS * (level + 1)))) {
+        level++;
     }
-    if (ch == EOF) {
-        return NULL;
+    if (delta >= (1UL << (WHEEL_BITS * WHEEL_LEVELS))) {
+        timer->expires = wheel.now + (1UL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
     }
-    buffer[i] = '\0';
-    return buffer;
+    Timer *head = &wheel.slots[level][(timer->expires >> (WHEEL_BITS * level))
+            & (WHEEL_SIZE - 1)];
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+    timer->armed = 1;
 }
 
+/* take timer out of its slot, wheel must be locked */
+void wheel_remove(Timer *timer) {
+    if (timer->armed) {
+        timer->prev->next = timer->next;
+        timer->next->prev = timer->prev;
+        timer->armed = 0;
+    }
+}
 
 /*
- * add a new station's name and fd into connected station
- * linked list "head"
+ * arm timer to fire after the given number of ticks, replacing any earlier
+ * expiry. Safe to call from a fire callback.
  */
-void add_connected(Connected *head, char *n, int fd) {
-    Connected *new, *pre;
-    pre = head;
-    if (pre->next != NULL) {
-        while (pre->next->next != NULL) {
-            if (strcmp(n, pre->next->name) < 0) {
-                break;
-            } else {
-                pre = pre->next;
-            }
-        }
-        if (!(strcmp(n, pre->next->name) < 0)) {
-            pre = pre->next;
-        }
-    }
+void rearm_timer(Timer *timer, unsigned long ticks) {
+    wheel_remove(timer);
+    timer->expires = wheel.now + ((ticks == 0) ? 1 : ticks);
+    wheel_insert(timer);
+}
 
-    if ((new = (Connected *)malloc(sizeof(Connected))) == NULL) {
-        error(99);
-    }
-    new->name = n;
-    new->fd = fd;
-    new->next = pre->next;
-    pre->next = new;
+/* arm timer to call fire(timer) after the given number of ticks */
+void start_timer(Timer *timer, unsigned long ticks, void (*fire)(Timer *),
+        void *owner) {
+    sem_wait(&wheel.lock);
+    timer->fire = fire;
+    timer->owner = owner;
+    rearm_timer(timer, ticks);
+    sem_post(&wheel.lock);
 }
 
 /*
- * check if the station name is already in connected station
- * linked list "head"
- * return 1 if already in the list, otherwise return 0
+ * stop timer if it is armed. Once this returns the callback is not running
+ * and will not run again.
  */
-int has_connected(Connected *head, char *n) {
-    if (head->next == NULL) {
-        return 0;
-    }
-    Connected *p = head->next;
-    while ((p->next) != NULL) {
-        if (strcmp(p->name, n) == 0) {
-            return 1;
+void cancel_timer(Timer *timer) {
+    sem_wait(&wheel.lock);
+    wheel_remove(timer);
+    sem_post(&wheel.lock);
+}
+
+/*
+ * move one tick forward: when a level wraps, spread the next slot of the
+ * level above into the lower levels, then fire every timer due now
+ */
+void wheel_advance(void) {
+    wheel.now++;
+    for (int level = 1; level < WHEEL_LEVELS; level++) {
+        if ((wheel.now & ((1UL << (WHEEL_BITS * level)) - 1)) != 0) {
+            break;
+        }
+        Timer *head = &wheel.slots[level][(wheel.now >>
+                (WHEEL_BITS * level)) & (WHEEL_SIZE - 1)];
+        while (head->next != head) {
+            Timer *timer = head->next;
+            wheel_remove(timer);
+            wheel_insert(timer);
         }
-        p = p->next;
     }
-    if (strcmp(p->name, n) == 0) {
-        return 1;
-    } else {
-        return 0;
+    Timer *head = &wheel.slots[0][wheel.now & (WHEEL_SIZE - 1)];
+    while (head->next != head) {
+        Timer *timer = head->next;
+        wheel_remove(timer);
+        timer->fire(timer);
     }
 }
 
-/*
- * remove the station that has name n from the connected station list head
- */
-void remove_connected(Connected *head, char *n) {
-    Connected *now, *pre;
-    pre = head;
-    if (head->next != NULL) {
-        now = pre->next;
-        while (now->next != NULL) {
-            if (strcmp(n, now->name) == 0) {
-                break;
-            } else {
-                pre = pre->next;
-                now = now->next;
-            }
+/* return the monotonic clock in nanoseconds */
+long now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+/* keep one tracepoint hit in the trace ring, over the oldest one */
+void trace_record(const char *point, int kind, const char *peer, long size) {
+    unsigned long position = __atomic_fetch_add(&traceRing.next, 1,
+            __ATOMIC_RELAXED);
+    TraceEntry *entry = &traceRing.entries[position & traceRing.mask];
+    __atomic_store_n(&entry->sequence, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    entry->time = now_ns();
+    entry->size = size;
+    entry->point = point;
+    entry->kind = kind;
+    strncpy(entry->peer, (peer != NULL) ? peer : "-", TRACE_NAME - 1);
+    entry->peer[TRACE_NAME - 1] = '\0';
+    __atomic_store_n(&entry->sequence, position + 1, __ATOMIC_RELEASE);
+}
+
+/* advance the wheel once every WHEEL_TICK milliseconds */
+void *wheel_thread(void *arg) {
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (1) {
+        next.tv_nsec += WHEEL_TICK * 1000000L;
+        if (next.tv_nsec >= 1000000000L) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000L;
         }
-        if (strcmp(n, now->name) == 0) {
-            pre->next = now->next;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        sem_wait(&wheel.lock);
+        wheel_advance();
+        sem_post(&wheel.lock);
+    }
+    return NULL;
+}
+
+/* set up the empty wheel and start its thread */
+void start_wheel(void) {
+    pthread_t threadId;
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int i = 0; i < WHEEL_SIZE; i++) {
+            wheel.slots[level][i].next = &wheel.slots[level][i];
+            wheel.slots[level][i].prev = &wheel.slots[level][i];
         }
     }
+    wheel.now = 0;
+    if (sem_init(&wheel.lock, 0, 1) == -1 ||
+            pthread_create(&threadId, NULL, wheel_thread, NULL) != 0) {
+        error(99);
+    }
+    pthread_detach(threadId);
 }
 
 /*
- * check and add the station into the connected station
- * linked list "head"
+ * timer callback that shuts the connection down, which makes any read_line()
+ * or fflush() blocked on it return
  */
-void process_station(Connected *head, Station *station, char *n, int fd) {
-    if (has_connected(head, n) || strcmp(n, station->name) == 0) {
-        error(7);
-    } else {
-        add_connected(head, n, fd);
-    }
+void shutdown_fired(Timer *timer) {
+    shutdown((int)(int64_t)timer->owner, SHUT_RDWR);
 }
 
 /*
- * takes in a station name n, and return that station's fd
+ * return size bytes from the newest block of list, adding a block when it
+ * has no room. Anything arenaBlock bytes or more gets a block of its own,
+ * put behind the newest so the rest of that block is still used
  */
-int get_fd(Connected *head, char *n) {
-    Connected *p = head->next;
-    while ((p->next) != NULL) {
-        if (strcmp(p->name, n) == 0) {
-            return p->fd;
+void *arena_take(ArenaBlock **list, long *held, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    ArenaBlock *block = *list;
+    if (block == NULL || block->size - block->used < size) {
+        size_t blockSize = (size < arenaBlock) ? arenaBlock : size;
+        if ((block = (ArenaBlock *)malloc(sizeof(ArenaBlock) +
+                blockSize)) == NULL) {
+            error(99);
         }
-        p = p->next;
+        block->size = blockSize;
+        block->used = 0;
+        if (size >= arenaBlock && *list != NULL) {
+            block->next = (*list)->next;
+            (*list)->next = block;
+        } else {
+            block->next = *list;
+            *list = block;
+        }
+        __atomic_add_fetch(held, sizeof(ArenaBlock) + blockSize,
+                __ATOMIC_RELAXED);
     }
-    return p->fd;
+    block->used += size;
+    return block->data + block->used - size;
+}
+
+/* free block, taking its bytes off held */
+void arena_free_block(ArenaBlock *block, long *held) {
+    __atomic_sub_fetch(held, sizeof(ArenaBlock) + block->size,
+            __ATOMIC_RELAXED);
+    free(block);
+}
+
+/* return size bytes that last until the arena is released */
+void *arena_keep(Arena *arena, size_t size) {
+    return arena_take(&arena->kept, &arena->held, size);
 }
 
+/* return a copy of str that lasts until the arena is released */
+char *arena_strdup(Arena *arena, const char *str) {
+    return strcpy((char *)arena_keep(arena, strlen(str) + 1), str);
+}
 
 /*
- * add a new resource name and quantity into resource
- * linked list "head"
+ * give back size bytes at data from arena_keep() if they have a block to
+ * themselves, otherwise they stay until the arena is released
  */
-void add_resource(Resource *head, char *n, int quantity) {
-    Resource *new, *pre;
-    pre = head;
-    if (pre->next != NULL) {
-        while (pre->next->next != NULL) {
-            if (strcmp(n, pre->next->name) < 0) {
-                break;
-            } else {
-                pre = pre->next;
-            }
-        }
-        if (!(strcmp(n, pre->next->name) < 0)) {
-            pre = pre->next;
-        }
+void arena_drop(Arena *arena, void *data, size_t size) {
+    if (size < arenaBlock) {
+        return;
     }
-    if ((new = (Resource *)malloc(sizeof(Resource))) == NULL) {
-        error(99);
+    for (ArenaBlock **at = &arena->kept; *at != NULL; at = &(*at)->next) {
+        if ((*at)->data == data) {
+            ArenaBlock *block = *at;
+            *at = block->next;
+            arena_free_block(block, &arena->held);
+            return;
+        }
     }
-    new->name = n;
-    new->quantity = quantity;
-    new->next = pre->next;
-    pre->next = new;
 }
 
 /*
- * check if the resource name is already in resource
- * linked list "head"
- * return 1 if already in the list, otherwise return 0
+ * empty the scratch blocks once a train is done with them, keeping one
+ * ordinary block for the next train
  */
-int has_resource(Resource *head, char *n) {
-    if (head->next == NULL) {
-        return 0;
-    }
-    Resource *p = head->next;
-    while ((p->next) != NULL) {
-        if (strcmp(p->name, n) == 0) {
-            return 1;
+void arena_reset(Arena *arena) {
+    ArenaBlock *spare = NULL;
+    while (arena->scratch != NULL) {
+        ArenaBlock *block = arena->scratch;
+        arena->scratch = block->next;
+        if (spare == NULL && block->size == arenaBlock) {
+            spare = block;
+        } else {
+            arena_free_block(block, &arena->held);
         }
-        p = p->next;
     }
-    if (strcmp(p->name, n) == 0) {
-        return 1;
-    } else {
-        return 0;
+    if (spare != NULL) {
+        spare->used = 0;
+        spare->next = NULL;
+        arena->scratch = spare;
     }
 }
 
-/*
- * takes in a resource name n, and a number of quantity q,
- * update that resource's quantity in the linked list head
- */
-void update_quantity(Resource *head, char *n, int q) {
-    Resource *p = head->next;
-    while ((p->next) != NULL) {
-        if (strcmp(p->name, n) == 0) {
-            p->quantity += q;
-            return;
+/* free everything in the arena */
+void arena_release(Arena *arena) {
+    ArenaBlock *lists[2] = {arena->kept, arena->scratch};
+    for (int i = 0; i < 2; i++) {
+        while (lists[i] != NULL) {
+            ArenaBlock *block = lists[i];
+            lists[i] = block->next;
+            arena_free_block(block, &arena->held);
         }
-        p = p->next;
     }
-    p->quantity += q;
+    arena->kept = NULL;
+    arena->scratch = NULL;
 }
 
 /*
- * check and load the resource into the resource
- * linked list "head"
+ * return size bytes for the train being processed: from the scratch arena
+ * in a reader thread, otherwise malloc'd. Either way scratch_free() them
  */
-void process_resource(Resource *head, char *n, int q) {
-    if (has_resource(head, n)) {
-        update_quantity(head, n, q);
-    } else {
+void *scratch_alloc(size_t size) {
+    void *data;
+    if (scratch != NULL) {
+        return arena_take(&scratch->scratch, &scratch->held, size);
+    }
+    if ((data = malloc(size)) == NULL) {
+        error(99);
+    }
+    return data;
+}
 
-        add_resource(head, n, q);
+/* free data from scratch_alloc(), which a reader's arena does for it */
+void scratch_free(void *data) {
+    if (scratch == NULL) {
+        free(data);
     }
 }
 
-/*
- * takes in a resources name n, and return that resource's quantity
- */
-int get_quantity(Resource *head, char *n) {
-    Resource *p = head->next;
-    while ((p->next) != NULL) {
-        if (strcmp(p->name, n) == 0) {
-            return p->quantity;
-        }
-        p = p->next;
+/* return the text made from format and args, as scratch_alloc() */
+char *scratch_vprintf(const char *format, va_list args) {
+    va_list again;
+    va_copy(again, args);
+    int length = vsnprintf(NULL, 0, format, args);
+    if (length < 0) {
+        error(99);
     }
-    return p->quantity;
+    char *text = (char *)scratch_alloc(length + 1);
+    vsnprintf(text, length + 1, format, again);
+    va_end(again);
+    return text;
 }
 
 /*
- * given a exit Status, print the log append to the logfile
+ * set up an empty reader over socket fd with an arena of its own. Reads
+ * interrupted by a signal give up only while *stop is set.
  */
-void print_log(int exitStatus, Station *station, Connected *connected, 
-        Resource *resource) {
-    FILE *logfile = fopen(station->logfile, "a");
-    if (logfile == NULL) {
-        error(3);
+void reader_init(Reader *reader, int fd, int *stop) {
+    reader->fd = fd;
+    reader->arena.kept = NULL;
+    reader->arena.scratch = NULL;
+    reader->arena.held = 0;
+    reader->size = 4096;
+    reader->data = (char *)arena_keep(&reader->arena, reader->size);
+    reader->start = 0;
+    reader->end = 0;
+    reader->last = 0;
+    reader->stop = stop;
+}
+
+/*
+ * move the reader's buffer to a new one of size bytes from its arena,
+ * unconsumed bytes first, giving the old one back
+ */
+void reader_resize(Reader *reader, int size) {
+    char *data = (char *)arena_keep(&reader->arena, size);
+    memcpy(data, reader->data + reader->start, reader->end - reader->start);
+    arena_drop(&reader->arena, reader->data, reader->size);
+    reader->data = data;
+    reader->size = size;
+    reader->end -= reader->start;
+    reader->start = 0;
+    reader->last = 0;
+}
+
+/*
+ * wait for more from the socket and read it into the reader's free space.
+ * return 0 at the end of the stream, on an error or when a wake-up asks
+ * the reader to stop, with errno 0 at the end of the stream, otherwise 1
+ */
+int reader_fill(Reader *reader) {
+    struct pollfd ready = {reader->fd, POLLIN, 0};
+    if (ppoll(&ready, 1, NULL, &wakeMask) < 0) {
+        return errno == EINTR && !*reader->stop;
     }
-    fprintf(logfile, "=======\n");
-    fprintf(logfile, "%s\n", station->name);
-    fprintf(logfile, "Processed: %d\n", station->processed);
-    fprintf(logfile, "Not mine: %d\n", station->notMine);
-    fprintf(logfile, "Format err: %d\n", station->formatErr);
-    fprintf(logfile, "No fwd: %d\n", station->noFwd);
-    if (connected->next == NULL) {
-        fprintf(logfile, "NONE\n");
-    } else {
-        Connected *p = connected->next;
-        while ((p->next) != NULL) {
-            fprintf(logfile, "%s,", p->name);
-            p = p->next;
+    int got = read(reader->fd, reader->data + reader->end,
+            reader->size - reader->end);
+    if (got <= 0) {
+        if (got == 0) {
+            errno = 0;
         }
-        fprintf(logfile, "%s\n", p->name);
+        return 0;
     }
-    if (resource->next == NULL) {
-    } else {
-        Resource *p = resource->next;
-        while ((p->next) != NULL) {
-            fprintf(logfile, "%s %d\n", p->name, p->quantity);
-            p = p->next;
+    reader->end += got;
+    return 1;
+}
+
+/*
+ * return the next line from the reader without its newline, reading more
+ * from the socket as needed. return NULL at the end of the stream, on an
+ * error or when interrupted while *stop is set (errno is then EINTR)
+ */
+char *reader_line(Reader *reader) {
+    int scanned = reader->start;
+    while (1) {
+        char *newline = memchr(reader->data + scanned, '\n',
+                reader->end - scanned);
+        if (newline != NULL) {
+            *newline = '\0';
+            reader->last = reader->start;
+            reader->start = newline - reader->data + 1;
+            return reader->data + reader->last;
+        }
+        if (reader->start > 0) {
+            memmove(reader->data, reader->data + reader->start,
+                    reader->end - reader->start);
+            reader->end -= reader->start;
+            reader->start = 0;
+        }
+        scanned = reader->end;
+        if (reader->end == reader->size) {
+            reader_resize(reader, reader->size * 2);
+        }
+        if (reader_fill(reader) == 0) {
+            return NULL;
         }
-        fprintf(logfile, "%s %d\n", p->name, p->quantity);
-    }
-    if (exitStatus == 1) {
-        fprintf(logfile, "doomtrain\n");
-    } else if (exitStatus == 2) {
-        fprintf(logfile, "stopstation\n");
     }
-    fclose(logfile);
+}
+
+/* put the line returned by the last reader_line() back, unprocessed */
+void reader_unread(Reader *reader) {
+    reader->data[reader->start - 1] = '\n';
+    reader->start = reader->last;
 }
 
 /*
- * interpret hot name to ip address,
- * if cannot interpret, return NULL,
- * otherwise, return the address pointer
+ * decode a varint of at most 5 bytes from data at position, moving position
+ * past it. return 1 if decoded, 0 if data ends first or -1 if it is too long
  */
-struct in_addr *name_to_ip_addr(char *hostname) {
-    int error;
-    struct addrinfo *addressInfo;
-
-    error = getaddrinfo(hostname, NULL, NULL, &addressInfo);
-    if (error) {
-        return NULL;
+int frame_varint(unsigned char *data, int length, int *position,
+        unsigned long *value) {
+    *value = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (*position >= length) {
+            return 0;
+        }
+        unsigned char byte = data[(*position)++];
+        *value |= (unsigned long)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return 1;
+        }
     }
-    return &(((struct sockaddr_in*)(addressInfo->ai_addr))->sin_addr);
+    return -1;
 }
 
 /*
- * connect to the given ip address and port, return the fd
+ * return the payload of the next frame from the reader and set length to
+ * its size, reading more from the socket as needed. return NULL like
+ * reader_line(), or with errno 0 for a frame no station would send
  */
-int connect_to(struct in_addr *ipAddress, int port) {
-    struct sockaddr_in socketAddr;
-    int fd;
-    fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (fd < 0) {
-        error(6);
-    }
-    socketAddr.sin_family = AF_INET;
-    socketAddr.sin_port = htons(port);
-    socketAddr.sin_addr.s_addr = ipAddress->s_addr;
-    if (connect(fd, (struct sockaddr*)&socketAddr, sizeof(socketAddr)) < 0) {
-        error(6);
+char *reader_frame(Reader *reader, int *length) {
+    while (1) {
+        int position = reader->start;
+        unsigned long size;
+        int header = frame_varint((unsigned char *)reader->data, reader->end,
+                &position, &size);
+        if (header < 0 || (header > 0 && size > FRAME_MAX)) {
+            errno = 0;
+            return NULL;
+        }
+        if (header > 0 && position + size <= reader->end) {
+            reader->last = reader->start;
+            reader->start = position + size;
+            *length = size;
+            return reader->data + position;
+        }
+        int needed = (header > 0) ? position - reader->start + size :
+                reader->end - reader->start + 1;
+        if (reader->start > 0) {
+            memmove(reader->data, reader->data + reader->start,
+                    reader->end - reader->start);
+            reader->end -= reader->start;
+            reader->start = 0;
+        }
+        int grown = reader->size;
+        while (grown < needed) {
+            grown *= 2;
+        }
+        if (grown > reader->size) {
+            reader_resize(reader, grown);
+        }
+        if (reader_fill(reader) == 0) {
+            return NULL;
+        }
     }
-    return fd;
 }
 
-#define MAXHOSTNAMELEN 128
-
-void *client_thread(void *arg);
+/* put the frame returned by the last reader_frame() back, unprocessed */
+void reader_unframe(Reader *reader) {
+    reader->start = reader->last;
+}
 
 /*
- * takes in a fd and get and print the binding port
+ * return 1 if the next reader_line(), or reader_frame() with framing set,
+ * needs nothing more from the socket, otherwise return 0
  */
-void print_port(int fd) {
-    struct sockaddr_in add;
-    socklen_t len = sizeof(add);
-    if (getsockname(fd, (struct sockaddr *)&add, &len) < 0) {
-        error(99);
-    } else {
-        printf("%d\n", ntohs(add.sin_port));
-        fflush(stdout);
+int reader_ready(Reader *reader, int framing) {
+    if (!framing) {
+        return memchr(reader->data + reader->start, '\n',
+                reader->end - reader->start) != NULL;
     }
+    int position = reader->start;
+    unsigned long size;
+    int header = frame_varint((unsigned char *)reader->data, reader->end,
+            &position, &size);
+    return header < 0 || (header > 0 && (size > FRAME_MAX ||
+            position + size <= reader->end));
 }
 
 /*
- * start to listen to the given port and interface(if is specified)
+ * wait while a live upgrade is in progress. If the upgrade succeeds the
+ * process exits here, otherwise the upgrade thread lets everyone go again.
  */
-int open_listen(int port, int argc, char *argv[]) {
-    int fd, optVal = 1;
-    struct sockaddr_in serverAddr;
-    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        error(5);
+void park_thread(Station *station) {
+    __sync_fetch_and_add(&station->parked, 1);
+    sem_wait(&parkSem);
+    __sync_fetch_and_sub(&station->parked, 1);
+}
+
+/*
+ * use a dynamic buffer to read one line from given file pointer
+ * return a char pointer for that line
+ */
+char *read_line(FILE *readF) {
+    char ch;
+    int len = 1;
+    char *buffer = (char*)malloc(sizeof(char) * len);
+    int i = 0;
+    while (((ch = fgetc(readF)) != EOF) && (ch != '\n')) {
+        buffer[i] = ch;
+        i++;
+        if (i == len) {
+            len *= 2;
+            buffer = (char*)realloc(buffer, sizeof(char) * len);
+        }
     }
-    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optVal, sizeof(int)) < 0) {
-        error(5);
+    if (ch == EOF) {
+        free(buffer);
+        return NULL;
     }
-    if (argc == 6) {
-        struct addrinfo hints;
-        struct addrinfo *result, *rp;
-        memset(&hints, 0, sizeof(struct addrinfo));
-        hints.ai_family = AF_UNSPEC;
-        hints.ai_socktype = SOCK_DGRAM;
-        hints.ai_flags = AI_PASSIVE;
-        hints.ai_protocol = 0;
-        hints.ai_canonname = NULL;
-        hints.ai_addr = NULL;
-        hints.ai_next = NULL;
-        if ((getaddrinfo(argv[5], argv[4], &hints, &result)) != 0) {
+    buffer[i] = '\0';
+    return buffer;
+}
+
+
+/* append one byte to the record being built */
+void record_byte(Record *record, unsigned char byte) {
+    if (record->length == record->size) {
+        record->size = (record->size == 0) ? 64 : record->size * 2;
+        record->data = (unsigned char *)realloc(record->data,
+                sizeof(unsigned char) * record->size);
+        if (record->data == NULL) {
             error(99);
         }
-        for (rp = result; rp != NULL; rp = rp->ai_next) {
-            if (bind(fd, rp->ai_addr, rp->ai_addrlen) == 0) {
-                break;
-            }
+    }
+    record->data[record->length++] = byte;
+}
+
+/* append length bytes of data to the record */
+void record_bytes(Record *record, const void *data, int length) {
+    if (record->length + length > record->size) {
+        while (record->length + length > record->size) {
+            record->size = (record->size == 0) ? 64 : record->size * 2;
         }
-        if (rp == NULL) {
-            error(5);
+        record->data = (unsigned char *)realloc(record->data,
+                sizeof(unsigned char) * record->size);
+        if (record->data == NULL) {
+            error(99);
         }
-        freeaddrinfo(result);
+    }
+    memcpy(record->data + record->length, data, length);
+    record->length += length;
+}
+
+/* append an unsigned LEB128 varint to the record */
+void record_varint(Record *record, unsigned long value) {
+    while (value >= 0x80) {
+        record_byte(record, (value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    record_byte(record, value);
+}
+
+/* append a zigzag encoded signed varint to the record */
+void record_signed(Record *record, long value) {
+    if (value < 0) {
+        record_varint(record, ((unsigned long)(-(value + 1)) << 1) | 1);
     } else {
-        serverAddr.sin_family = AF_INET;
-        serverAddr.sin_port = htons(port);
-        serverAddr.sin_addr.s_addr = htonl(INADDR_ANY);
-        if (bind(fd, (struct sockaddr*)&serverAddr, 
-                sizeof(struct sockaddr_in)) < 0) {
-            error(5);
-        }
+        record_varint(record, (unsigned long)value << 1);
     }
-    if (listen(fd, SOMAXCONN) < 0) {
-        error(5);
+}
+
+/* append a length prefixed string to the record */
+void record_string(Record *record, char *str) {
+    int length = strlen(str);
+    record_varint(record, length);
+    for (int i = 0; i < length; i++) {
+        record_byte(record, str[i]);
     }
-    print_port(fd);
-    return fd;
 }
 
 /*
- * handle incoming connections, if connected successfully, add the station to
- * the linked list "connected", and start a new thread to deal with it.
+ * write a record of the given type to file f, and empty it for the next one
  */
-void process_connections(int fdServer, Station *station, Connected *connected,
-        Resource *resource) {
-    int fd;
-    struct sockaddr_in fromAddr;
-    socklen_t fromAddrSize;
-    pthread_t threadId;
+void write_record(FILE *f, int type, Record *record) {
+    Record header = {NULL, 0, 0};
+    unsigned char buffer[16];
+    header.data = buffer;
+    header.size = sizeof(buffer);
+    record_byte(&header, type);
+    record_varint(&header, record->length);
+    fwrite(header.data, 1, header.length, f);
+    fwrite(record->data, 1, record->length, f);
+    record->length = 0;
+}
+
+/*
+ * append piece to frame as a SEGMENT_RESOURCES segment if it is resource
+ * cargo that decodes back to exactly the same text: canonical quantities
+ * of at most 9 digits, and no name that could make it another kind of
+ * cargo. return 0 and append nothing otherwise
+ */
+int frame_resources(Record *frame, char *piece) {
+    Record content = {NULL, 0, 0};
+    char *p = piece;
     while (1) {
-        fromAddrSize = sizeof(struct sockaddr_in);
-        fd = accept(fdServer, (struct sockaddr*)&fromAddr, &fromAddrSize);
-        if (fd < 0) {
-            error(99);
-        }
-        FILE *readF = fdopen(fd, "r");
-        FILE *writeF = fdopen(fd, "w");
-        char *buffer;
-        buffer = read_line(readF);
-        if (strlen(buffer) == 0) {
-            close(fd);
-            continue;
-        }
-        int a;
-        if ((a = (strcmp(buffer, station->auth)) != 0)) {
-            close(fd);
-            continue;
-        }
-        buffer = read_line(readF);
-        if (strlen(buffer) == 0) {
-            close(fd);
-            continue;
+        size_t nameLength = strcspn(p, ",+-(");
+        char operator = p[nameLength];
+        char *number = p + nameLength + 1;
+        size_t digits = (operator == '+' || operator == '-') ?
+                strspn(number, "0123456789") : 0;
+        if (nameLength == 0 || strchr("#@[", *p) != NULL || digits == 0 ||
+                digits > 9 || (*number == '0' && (digits > 1 ||
+                operator == '-')) ||
+                (number[digits] != ',' && number[digits] != '\0')) {
+            free(content.data);
+            return 0;
         }
-        fprintf(writeF, "%s\n", station->name);
-        fflush(writeF);
-        sem_wait(&sem);
-        process_station(connected, station, buffer, fd);
-        sem_post(&sem);
-        Threadinfo *info;
-        if((info = (Threadinfo *)malloc(sizeof(Threadinfo))) == NULL) {
-            error(99);
+        record_varint(&content, nameLength);
+        record_bytes(&content, p, nameLength);
+        long quantity = strtol(number, NULL, 10);
+        record_signed(&content, (operator == '-') ? -quantity : quantity);
+        if (number[digits] == '\0') {
+            break;
         }
-        info->fd = fd;
-        info->fp = readF;
-        info->name = buffer;
-        info->station = station;
-        info->connected = connected;
-        info->resource = resource;
-        pthread_create(&threadId, NULL, client_thread, (void*)(int64_t)info);
-        pthread_detach(threadId);
+        p = number + digits + 1;
     }
+    record_byte(frame, SEGMENT_RESOURCES);
+    record_varint(frame, content.length);
+    record_bytes(frame, content.data, content.length);
+    free(content.data);
+    return 1;
 }
 
 /*
- * handle doomtrain, sent doomtrain to all connected stations
+ * encode the text train line as a frame payload, see frame.h.
+ * line is cut up in the process
  */
-void process_doom_train(char *str, Threadinfo *info) {
-    if ((info->connected->next) != NULL) {
-        Connected *p = info->connected->next;
-        while ((p->next) != NULL) {
-            FILE *writeF = fdopen(p->fd, "w");
-            fprintf(writeF, "%s:doomtrain\n", p->name);
-            fflush(writeF);
-            p = p->next;
+void frame_train(Record *frame, char *line) {
+    char *piece = line;
+    while (1) {
+        char *end = (*piece == '[') ? piece + strlen(piece) :
+                piece + strcspn(piece, ":");
+        int last = (*end == '\0');
+        *end = '\0';
+        if (frame_resources(frame, piece) == 0) {
+            int length = end - piece;
+            record_byte(frame, SEGMENT_TEXT);
+            record_varint(frame, length);
+            record_bytes(frame, piece, length);
+        }
+        if (last) {
+            break;
         }
-        FILE *writeF = fdopen(p->fd, "w");
-        fprintf(writeF, "%s:doomtrain\n", p->name);
-        fflush(writeF);
+        piece = end + 1;
     }
 }
 
 /*
- * check add-train's format. return 0 if the format is invalid
- * otherwise return 1
+ * read the segment at position of a frame payload into segment, moving
+ * position past it. return 0 if the payload ends first
  */
-int add_train_validation(char *str) {
-    int isDigit = 1;
-    int at = 0;
-    int comma = 0;
-    int count = 0;
-    char *p = str;
-    if (*p == '@' || *p == ',') {
+int frame_segment(unsigned char *data, int length, int *position,
+        Segment *segment) {
+    unsigned long size;
+    if (*position >= length) {
         return 0;
     }
-    for (; *p != '\0'; p++) {
-        if (*p == '@') {
-            if (count == 0) {
-                return 0;
-            }
-            count = 0;
-            isDigit = 0;
-            at++;
-        } else if (*p == ',') {
-            if (count == 0) {
-                return 0;
-            }
-            count = 0;
-            isDigit = 1;
-            if (at == 0) {
-                return 0;
-            }
-            comma++;
-        } else {
-            if (isDigit == 1 && (*p < '0' || *p > '9')) {
-                return 0;
-            }
-            count++;
-        }
-    }
-    if (at - comma != 1) {
+    segment->start = *position;
+    segment->kind = data[(*position)++];
+    if (frame_varint(data, length, position, &size) != 1 ||
+            size > length - *position) {
         return 0;
     }
+    segment->data = data + *position;
+    segment->length = size;
+    *position += size;
     return 1;
 }
 
 /*
- * connect to the station with given hostname and port
- * return 1 if added successfully, otherwise return 0
+ * decode the resource at position of a SEGMENT_RESOURCES segment, moving
+ * position past it. return 0 if it is not one frame_resources() could have
+ * encoded
  */
-int connect_station(char *hostname, int port, Threadinfo *info) {
-    struct in_addr *ipAddress = name_to_ip_addr(hostname);
-    if (ipAddress == NULL) {
-        error(6);
+int segment_resource(Segment *segment, int *position, char **name,
+        int *nameLength, long *quantity) {
+    unsigned long size, value;
+    if (frame_varint(segment->data, segment->length, position, &size) != 1 ||
+            size == 0 || size > segment->length - *position) {
         return 0;
     }
-    int fd;
-    fd = connect_to(ipAddress, port);
-    FILE *readF = fdopen(fd, "r");
-    FILE *writeF = fdopen(fd, "w");
-    fprintf(writeF, "%s\n%s\n", info->station->auth, info->station->name);
-    fflush(writeF);
-    char *buffer = read_line(readF);
-    if (buffer != NULL) {
-        process_station(info->connected, info->station, buffer, fd);
-    } else {
+    *name = (char *)segment->data + *position;
+    *nameLength = size;
+    if (strchr("#@[", **name) != NULL) {
         return 0;
     }
-    pthread_t threadId;
-    Threadinfo *infoNew;
-    if((infoNew = (Threadinfo *)malloc(sizeof(Threadinfo))) == NULL) {
-        error(99);
+    for (int i = 0; i < size; i++) {
+        if (strchr(":,+-(\n", (*name)[i]) != NULL) {
+            return 0;
+        }
     }
-    infoNew->fd = fd;
-    infoNew->fp = readF;
-    infoNew->name = buffer;
-    infoNew->station = info->station;
-    infoNew->connected = info->connected;
-    infoNew->resource = info->resource;
-    pthread_create(&threadId, NULL, client_thread, (void*)(int64_t)infoNew);
-    pthread_detach(threadId);
-    return 1;
+    *position += size;
+    if (frame_varint(segment->data, segment->length, position, &value) != 1) {
+        return 0;
+    }
+    *quantity = (value & 1) ? -(long)(value >> 1) - 1 : (long)(value >> 1);
+    return *quantity >= -999999999 && *quantity <= 999999999;
 }
 
 /*
- * handle add train, check format first and then connect them
+ * check every resource of a SEGMENT_RESOURCES segment.
+ * return 0 if any is invalid or there is none, otherwise return 1
  */
-int process_add_train(char *str, Threadinfo *info) {
-    if (strchr(str, ')') == 0 || *(strchr(str, ')') + 1) != '\0' || 
-            strchr(str, '@') == 0) {
-        (info->station->formatErr)++;
-        return 0;
-    }
+int segment_valid(Segment *segment) {
+    int position = 0, nameLength;
+    char *name;
+    long quantity;
+    while (position < segment->length) {
+        if (segment_resource(segment, &position, &name, &nameLength,
+                &quantity) == 0) {
+            return 0;
+        }
+    }
+    return segment->length > 0;
+}
+
+/*
+ * turn a frame payload back into the text train it stands for.
+ * return it in a new buffer, or NULL if the payload is malformed
+ */
+char *frame_text(unsigned char *data, int length) {
+    Record text = {NULL, 0, 0};
+    Segment segment;
+    int position = 0;
+    while (position < length) {
+        if (frame_segment(data, length, &position, &segment) == 0 ||
+                (segment.kind == SEGMENT_TEXT &&
+                (memchr(segment.data, '\0', segment.length) != NULL ||
+                memchr(segment.data, '\n', segment.length) != NULL)) ||
+                (segment.kind == SEGMENT_RESOURCES &&
+                segment_valid(&segment) == 0) ||
+                segment.kind > SEGMENT_RESOURCES) {
+            free(text.data);
+            return NULL;
+        }
+        if (segment.kind == SEGMENT_TEXT) {
+            record_bytes(&text, segment.data, segment.length);
+        }
+        for (int at = 0; segment.kind == SEGMENT_RESOURCES &&
+                at < segment.length;) {
+            char *name, number[24];
+            int nameLength;
+            long quantity;
+            segment_resource(&segment, &at, &name, &nameLength, &quantity);
+            record_bytes(&text, name, nameLength);
+            record_bytes(&text, number, snprintf(number, sizeof(number),
+                    "%c%ld", (quantity < 0) ? '-' : '+', labs(quantity)));
+            if (at < segment.length) {
+                record_byte(&text, ',');
+            }
+        }
+        record_byte(&text, (position < length) ? ':' : '\0');
+    }
+    if (text.data == NULL) {
+        return NULL;
+    }
+    return (char *)text.data;
+}
+
+/*
+ * send the parts in order with as few writev calls as the socket allows,
+ * giving up if it fails. The parts are used up in the process
+ */
+void send_parts(int fd, struct iovec *part, int left) {
+    while (left > 0) {
+        ssize_t sent = writev(fd, part, left);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        } else if (sent <= 0) {
+            return;
+        }
+        while (left > 0 && sent >= (ssize_t)part->iov_len) {
+            sent -= part->iov_len;
+            part++;
+            left--;
+        }
+        if (left > 0) {
+            part->iov_base = (char *)part->iov_base + sent;
+            part->iov_len -= sent;
+        }
+    }
+}
+
+/* send a frame with the given payload, as much as the socket takes */
+void send_frame(int fd, unsigned char *data, int length) {
+    unsigned char buffer[8];
+    Record header = {buffer, 0, sizeof(buffer)};
+    record_varint(&header, length);
+    struct iovec parts[2] = {{buffer, header.length}, {data, length}};
+    send_parts(fd, parts, 2);
+}
+
+/*
+ * write the record built in station->record to the binary log as one
+ * record of the given type
+ */
+void log_record(Station *station, int type) {
+    write_record(station->logFp, type, &station->record);
+}
+
+/*
+ * record a delta of q applied to resource node, naming the resource first
+ * if this is the first time it appears in the binary log
+ */
+void log_delta(Station *station, Resource *node, int q) {
+    if (!station->logBinary) {
+        return;
+    }
+    if (node->logId < 0) {
+        node->logId = station->logNames++;
+        record_varint(&station->record, node->logId);
+        record_string(&station->record, node->name);
+        log_record(station, EVENT_NAME);
+    }
+    record_varint(&station->record, node->logId);
+    record_signed(&station->record, q);
+    log_record(station, EVENT_DELTA);
+}
+
+/* record a station connecting or disconnecting in the binary log */
+void log_connection(Station *station, int type, char *n) {
+    if (!station->logBinary) {
+        return;
+    }
+    record_string(&station->record, n);
+    log_record(station, type);
+}
+
+/*
+ * add a new station's name and fd into connected station
+ * linked list "head", return the new node
+ */
+Connected *add_connected(Connected *head, char *n, int fd) {
+    Connected *new, *pre;
+    pre = head;
+    if (pre->next != NULL) {
+        while (pre->next->next != NULL) {
+            if (strcmp(n, pre->next->name) < 0) {
+                break;
+            } else {
+                pre = pre->next;
+            }
+        }
+        if (!(strcmp(n, pre->next->name) < 0)) {
+            pre = pre->next;
+        }
+    }
+
+    if ((new = (Connected *)malloc(sizeof(Connected))) == NULL) {
+        error(99);
+    }
+    new->name = n;
+    new->fd = fd;
+    new->shed = 0;
+    new->ring = 0;
+    new->framing = 0;
+    new->dialed = 0;
+    new->outbox = NULL;
+    new->info = NULL;
+    new->peer = NULL;
+    new->next = pre->next;
+    pre->next = new;
+    return new;
+}
+
+/*
+ * check if the station name is already in connected station
+ * linked list "head"
+ * return 1 if already in the list, otherwise return 0
+ */
+int has_connected(Connected *head, char *n) {
+    if (head->next == NULL) {
+        return 0;
+    }
+    Connected *p = head->next;
+    while ((p->next) != NULL) {
+        if (strcmp(p->name, n) == 0) {
+            return 1;
+        }
+        p = p->next;
+    }
+    if (strcmp(p->name, n) == 0) {
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+/*
+ * remove the station that has name n from the connected station list head
+ */
+void remove_connected(Connected *head, char *n) {
+    Connected *now, *pre;
+    pre = head;
+    if (head->next != NULL) {
+        now = pre->next;
+        while (now->next != NULL) {
+            if (strcmp(n, now->name) == 0) {
+                break;
+            } else {
+                pre = pre->next;
+                now = now->next;
+            }
+        }
+        if (strcmp(n, now->name) == 0) {
+            pre->next = now->next;
+        }
+    }
+}
+
+/*
+ * takes in a station name n, and return its node in the connected station
+ * list head, or NULL if it is not connected
+ */
+Connected *get_connected(Connected *head, char *n) {
+    for (Connected *p = head->next; p != NULL; p = p->next) {
+        if (strcmp(p->name, n) == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/* send whatever is queued in p's outbox */
+void flush_outbox(Connected *p) {
+    Outbox *box = p->outbox;
+    if (box != NULL && box->count > 0) {
+        send_parts(p->fd, box->parts, box->count);
+        box->count = 0;
+        box->used = 0;
+    }
+}
+
+/*
+ * send the outboxes with trains in them: all of them if all is set,
+ * otherwise those whose oldest train has waited out the batch delay (all of
+ * them too without STATION_BATCH). Needs sem
+ */
+void flush_outboxes(int all) {
+    long now = (batch.delay > 0 && !all) ? now_ns() : 0;
+    Connected **at = &queuedPeers;
+    while (*at != NULL) {
+        Outbox *box = (*at)->outbox;
+        if (now > 0 && box->count > 0 && now - box->since < batch.delay) {
+            at = &box->nextQueued;
+            continue;
+        }
+        flush_outbox(*at);
+        box->queued = 0;
+        *at = box->nextQueued;
+    }
+}
+
+/*
+ * queue length bytes at data for peer socket p. Unless stable is set they
+ * are copied, as they may be gone before the outbox is sent; anything too
+ * big to copy is sent straight away instead. A full outbox is sent first.
+ * Needs sem
+ */
+void outbox_add(Connected *p, const void *data, int length, int stable) {
+    Outbox *box = p->outbox;
+    if (box == NULL) {
+        if ((box = p->outbox = (Outbox *)malloc(sizeof(Outbox))) == NULL ||
+                (box->copied = (char *)malloc(batch.bytes)) == NULL) {
+            error(99);
+        }
+        box->count = 0;
+        box->used = 0;
+        box->queued = 0;
+    }
+    if (!box->queued) {
+        box->queued = 1;
+        box->nextQueued = queuedPeers;
+        queuedPeers = p;
+        if (batch.waiting) {
+            batch.waiting = 0;
+            sem_post(&batch.wake);
+        }
+    }
+    /* batched trains outlive the reader's buffer */
+    stable = stable && batch.delay == 0;
+    if (box->count == OUTBOX_PARTS ||
+            (!stable && box->used + length > batch.bytes)) {
+        flush_outbox(p);
+    }
+    if (!stable && length > batch.bytes) {
+        struct iovec part = {(void *)data, length};
+        send_parts(p->fd, &part, 1);
+        return;
+    }
+    if (box->count == 0) {
+        box->since = (batch.delay > 0) ? now_ns() : 0;
+    }
+    if (!stable) {
+        memcpy(box->copied + box->used, data, length);
+        data = box->copied + box->used;
+        box->used += length;
+    }
+    struct iovec *last = box->parts + box->count - 1;
+    if (box->count > 0 && (char *)last->iov_base + last->iov_len == data) {
+        /* joins on to the part before, as copies do */
+        last->iov_len += length;
+    } else {
+        box->parts[box->count].iov_base = (void *)data;
+        box->parts[box->count++].iov_len = length;
+    }
+}
+
+/*
+ * queue a frame with the given payload for peer socket p, as outbox_add().
+ * An empty frame is its header alone
+ */
+void outbox_frame(Connected *p, unsigned char *data, int length, int stable) {
+    unsigned char buffer[8];
+    Record header = {buffer, 0, sizeof(buffer)};
+    record_varint(&header, length);
+    outbox_add(p, buffer, header.length, 0);
+    if (length > 0) {
+        outbox_add(p, data, length, stable);
+    }
+}
+
+/*
+ * return 1 if data lies in the buffer of info's reader, where it stays put
+ * until the reader reads again, otherwise return 0
+ */
+int in_reader(Threadinfo *info, const void *data) {
+    const char *at = (const char *)data;
+    return info->reader.data != NULL && at >= info->reader.data &&
+            at < info->reader.data + info->reader.end;
+}
+
+/*
+ * send one train line to connected station p: over its socket, as a frame
+ * if it takes frames, or for a tenant of this process, onto the queue
+ * drain_local works through. With STATION_BATCH socket trains go through
+ * p's outbox. Needs sem
+ */
+void deliver(Connected *p, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    if (p->peer != NULL) {
+        Pending *new;
+        if ((new = (Pending *)malloc(sizeof(Pending))) == NULL ||
+                vasprintf(&new->line, format, args) < 0) {
+            error(99);
+        }
+        new->info = p->peer->info;
+        new->next = NULL;
+        if (pendingTail == NULL) {
+            pending = new;
+        } else {
+            pendingTail->next = new;
+        }
+        pendingTail = new;
+    } else if (batch.delay > 0) {
+        /* held back with the trains forwarded to p */
+        char *line = scratch_vprintf(format, args);
+        Record frame = {NULL, 0, 0};
+        if (p->framing) {
+            frame_train(&frame, line);
+            outbox_frame(p, frame.data, frame.length, 0);
+            free(frame.data);
+        } else {
+            outbox_add(p, line, strlen(line), 0);
+            outbox_add(p, "\n", 1, 1);
+        }
+        scratch_free(line);
+    } else if (p->framing) {
+        char *line = scratch_vprintf(format, args);
+        Record frame = {NULL, 0, 0};
+        frame_train(&frame, line);
+        /* anything already queued for p goes first */
+        flush_outbox(p);
+        send_frame(p->fd, frame.data, frame.length);
+        free(frame.data);
+        scratch_free(line);
+    } else {
+        char *line = scratch_vprintf(format, args);
+        struct iovec parts[2] = {{line, strlen(line)}, {"\n", 1}};
+        flush_outbox(p);
+        send_parts(p->fd, parts, 2);
+        scratch_free(line);
+    }
+    va_end(args);
+}
+
+/*
+ * check and add the station into the connected station
+ * linked list "head", sending it frames if framing is set,
+ * return the new node
+ */
+Connected *process_station(Connected *head, Station *station, char *n,
+        int fd, int framing) {
+    if (has_connected(head, n) || strcmp(n, station->name) == 0) {
+        error(7);
+    }
+    log_connection(station, EVENT_CONNECT, n);
+    Connected *new = add_connected(head, n, fd);
+    new->framing = framing;
+    /* tell the new peer this station takes part in the ring */
+    if (station->ring != NULL) {
+        deliver(new, "%s:ring()", n);
+    }
+    return new;
+}
+
+/*
+ * settle a second link to station n, as when stations listed in each
+ * other's STATION_PEERS dial each other at once. Both ends keep the link
+ * dialed by the station with the lower name: return 1 if the new link
+ * (dialed by this station when dialed is set) is to be hung up on,
+ * otherwise shut the old link down, leaving its reader to finish it, and
+ * return 0. A link to this station itself is always hung up on.
+ */
+int settle_duplicate(Connected *head, Station *station, char *n,
+        int dialed) {
+    if (strcmp(n, station->name) == 0) {
+        return 1;
+    }
+    Connected *old = get_connected(head, n);
+    if (old == NULL) {
+        return 0;
+    }
+    int lower = dialed ? strcmp(station->name, n) < 0 :
+            strcmp(n, station->name) < 0;
+    if (!lower || old->dialed == dialed || old->info == NULL) {
+        return 1;
+    }
+    remove_connected(head, n);
+    shutdown(old->fd, SHUT_RDWR);
+    return 0;
+}
+
+/*
+ * add a new resource name and quantity into resource
+ * linked list "head", return the new node
+ */
+Resource *add_resource(Resource *head, char *n, int quantity) {
+    Resource *new, *pre;
+    pre = head;
+    if (pre->next != NULL) {
+        while (pre->next->next != NULL) {
+            if (strcmp(n, pre->next->name) < 0) {
+                break;
+            } else {
+                pre = pre->next;
+            }
+        }
+        if (!(strcmp(n, pre->next->name) < 0)) {
+            pre = pre->next;
+        }
+    }
+    if ((new = (Resource *)malloc(sizeof(Resource))) == NULL) {
+        error(99);
+    }
+    if ((new->name = strdup(n)) == NULL) {
+        error(99);
+    }
+    new->quantity = quantity;
+    new->logId = -1;
+    new->chain = NULL;
+    new->next = pre->next;
+    pre->next = new;
+    return new;
+}
+
+/* hash a string to 64 bits (FNV-1a, then mixed), never returning 0 */
+uint64_t hash_string(char *str) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *str != '\0'; str++) {
+        hash = (hash ^ (unsigned char)*str) * 1099511628211ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return (hash != 0) ? hash : 1;
+}
+
+/*
+ * takes in a resource name n, and return its node through the station's
+ * hash index, or NULL if the station does not hold it
+ */
+Resource *find_resource(Station *station, char *n) {
+    if (station->indexSize == 0) {
+        return NULL;
+    }
+    Resource *p = station->index[hash_string(n) & (station->indexSize - 1)];
+    while (p != NULL && strcmp(p->name, n) != 0) {
+        p = p->chain;
+    }
+    return p;
+}
+
+/*
+ * add resource node to the station's hash index, doubling the index when
+ * it holds as many names as it has chains
+ */
+void index_resource(Station *station, Resource *node) {
+    if (station->indexCount >= station->indexSize) {
+        int size = (station->indexSize == 0) ? 64 : station->indexSize * 2;
+        Resource **index = (Resource **)calloc(size, sizeof(Resource *));
+        if (index == NULL) {
+            error(99);
+        }
+        for (int i = 0; i < station->indexSize; i++) {
+            while (station->index[i] != NULL) {
+                Resource *p = station->index[i];
+                station->index[i] = p->chain;
+                p->chain = index[hash_string(p->name) & (size - 1)];
+                index[hash_string(p->name) & (size - 1)] = p;
+            }
+        }
+        free(station->index);
+        station->index = index;
+        station->indexSize = size;
+    }
+    Resource **chain = &station->index[hash_string(node->name) &
+            (station->indexSize - 1)];
+    node->chain = *chain;
+    *chain = node;
+    station->indexCount++;
+}
+
+/*
+ * check and load the resource into the resource
+ * linked list "head", finding it through the station's hash index,
+ * return its node
+ */
+Resource *process_resource(Station *station, Resource *head, char *n,
+        int q) {
+    Resource *node = find_resource(station, n);
+    if (node != NULL) {
+        node->quantity += q;
+    } else {
+        node = add_resource(head, n, q);
+        index_resource(station, node);
+    }
+    return node;
+}
+
+/*
+ * takes in a route name n, return its template through the station's
+ * route index or NULL if it was never registered here
+ */
+Route *get_route(Station *station, char *n) {
+    if (station->routeIndexSize == 0) {
+        return NULL;
+    }
+    Route *p = station->routeIndex[hash_string(n) &
+            (station->routeIndexSize - 1)];
+    while (p != NULL && strcmp(p->name, n) != 0) {
+        p = p->chain;
+    }
+    return p;
+}
+
+/*
+ * add route to the station's route index, doubling the index when it
+ * holds as many routes as it has chains
+ */
+void index_route(Station *station, Route *route) {
+    if (station->routeCount >= station->routeIndexSize) {
+        int size = (station->routeIndexSize == 0) ? 64 :
+                station->routeIndexSize * 2;
+        Route **index = (Route **)calloc(size, sizeof(Route *));
+        if (index == NULL) {
+            error(99);
+        }
+        for (int i = 0; i < station->routeIndexSize; i++) {
+            while (station->routeIndex[i] != NULL) {
+                Route *p = station->routeIndex[i];
+                station->routeIndex[i] = p->chain;
+                p->chain = index[hash_string(p->name) & (size - 1)];
+                index[hash_string(p->name) & (size - 1)] = p;
+            }
+        }
+        free(station->routeIndex);
+        station->routeIndex = index;
+        station->routeIndexSize = size;
+    }
+    Route **chain = &station->routeIndex[hash_string(route->name) &
+            (station->routeIndexSize - 1)];
+    route->chain = *chain;
+    *chain = route;
+    station->routeCount++;
+}
+
+/*
+ * register route n with next hop (NULL if this station ends the route),
+ * replacing any earlier template of the same name
+ */
+void set_route(Station *station, char *n, char *hop) {
+    Route *route = get_route(station, n);
+    if (route == NULL) {
+        if ((route = (Route *)malloc(sizeof(Route))) == NULL ||
+                (route->name = strdup(n)) == NULL) {
+            error(99);
+        }
+        route->next = station->routes;
+        station->routes = route;
+        index_route(station, route);
+    } else {
+        free(route->hop);
+    }
+    route->hop = NULL;
+    if (hop != NULL && (route->hop = strdup(hop)) == NULL) {
+        error(99);
+    }
+}
+
+/*
+ * test the Bloom filter bits of hash in generation, setting them as well if
+ * set is 1. return 1 if they were all set already, otherwise return 0
+ */
+int generation_filter(Dedup *dedup, Generation *generation, uint64_t hash,
+        int set) {
+    uint64_t *block = generation->filter[((hash & 0xffffffff) *
+            dedup->blockNumber) >> 32];
+    uint64_t bits = hash * 0x9e3779b97f4a7c15ULL;
+    int found = 1;
+    for (int i = 0; i < DEDUP_HASHES; i++, bits >>= 9) {
+        uint64_t mask = 1ULL << (bits & 63);
+        if ((block[(bits >> 6) & 7] & mask) == 0) {
+            if (!set) {
+                return 0;
+            }
+            found = 0;
+            block[(bits >> 6) & 7] |= mask;
+        }
+    }
+    return found;
+}
+
+/*
+ * look hash up in generation, inserting it if insert is set and it is not
+ * there. return 1 if it was already there, otherwise return 0
+ */
+int generation_find(Dedup *dedup, Generation *generation, uint64_t hash,
+        int insert) {
+    int bucket = (int)(((hash >> 32) * dedup->bucketNumber) >> 32);
+    while (1) {
+        for (int i = 0; i < DEDUP_SLOTS; i++) {
+            if (generation->buckets[bucket][i] == hash) {
+                return 1;
+            } else if (generation->buckets[bucket][i] == 0) {
+                if (insert) {
+                    generation->buckets[bucket][i] = hash;
+                    generation->count++;
+                }
+                return 0;
+            }
+        }
+        bucket = (bucket + 1 == dedup->bucketNumber) ? 0 : bucket + 1;
+    }
+}
+
+/*
+ * check train ID id against the dedup cache, called with sem held.
+ * return 1 if it was seen within the window, otherwise remember it and
+ * return 0. Always return 0 when deduplication is off.
+ */
+int dedup_seen(Station *station, char *id) {
+    Dedup *dedup = station->dedup;
+    if (dedup == NULL) {
+        return 0;
+    }
+    Generation *current = &dedup->generations[dedup->current];
+    if (wheel.now - current->started >= dedup->period ||
+            current->count >= dedup->capacity) {
+        dedup->current = (dedup->current + 1) % DEDUP_GENERATIONS;
+        current = &dedup->generations[dedup->current];
+        memset(current->filter, 0,
+                sizeof(*current->filter) * dedup->blockNumber);
+        memset(current->buckets, 0,
+                sizeof(*current->buckets) * dedup->bucketNumber);
+        current->started = wheel.now;
+        current->count = 0;
+    }
+    uint64_t hash = hash_string(id);
+    for (int i = 0; i < DEDUP_GENERATIONS; i++) {
+        if (i != dedup->current &&
+                generation_filter(dedup, &dedup->generations[i], hash, 0) &&
+                generation_find(dedup, &dedup->generations[i], hash, 0)) {
+            return 1;
+        }
+    }
+    if (generation_filter(dedup, current, hash, 1) == 0) {
+        /* certainly new, so the table only needs a free slot */
+        generation_find(dedup, current, hash, 1);
+        return 0;
+    }
+    return generation_find(dedup, current, hash, 1);
+}
+
+/*
+ * takes in a resources name n, and return that resource's quantity
+ */
+int get_quantity(Resource *head, char *n) {
+    Resource *p = head->next;
+    while ((p->next) != NULL) {
+        if (strcmp(p->name, n) == 0) {
+            return p->quantity;
+        }
+        p = p->next;
+    }
+    return p->quantity;
+}
+
+/*
+ * return the bytes connected station p holds: its node, reader state,
+ * arena and outbox. Needs sem
+ */
+long peer_bytes(Connected *p) {
+    Threadinfo *info = __atomic_load_n(&p->info, __ATOMIC_ACQUIRE);
+    long bytes = sizeof(Connected);
+    if (info != NULL) {
+        bytes += sizeof(Threadinfo) + info->capture.size +
+                __atomic_load_n(&info->reader.arena.held, __ATOMIC_RELAXED);
+    }
+    if (p->outbox != NULL) {
+        bytes += sizeof(Outbox) + batch.bytes;
+    }
+    return bytes;
+}
+
+/*
+ * record a dump in the binary log. Resources and connections are already
+ * logged as they change, so only the counters that moved since the last
+ * dump and the per-station shed counts are written.
+ */
+void log_snapshot(int exitStatus, Station *station, Connected *connected) {
+    int counters[SNAPSHOT_COUNTERS] = {station->processed, station->notMine,
+            station->formatErr, station->noFwd, station->shed};
+    int shedders = 0;
+    if (exitStatus) {
+        record_varint(&station->record, exitStatus);
+        log_record(station, EVENT_EXIT);
+    }
+    record_byte(&station->record,
+            ((station->rateLimit != NULL) ? SNAPSHOT_SHED : 0) |
+            ((station->dedup != NULL) ? SNAPSHOT_DUPLICATE : 0) |
+            (arenaLogged ? SNAPSHOT_MEMORY : 0));
+    for (int i = 0; i < SNAPSHOT_COUNTERS; i++) {
+        record_signed(&station->record, counters[i] - station->logged[i]);
+        station->logged[i] = counters[i];
+    }
+    for (Connected *p = connected->next; p != NULL; p = p->next) {
+        if (p->shed > 0) {
+            shedders++;
+        }
+    }
+    record_varint(&station->record, shedders);
+    for (Connected *p = connected->next; p != NULL; p = p->next) {
+        if (p->shed > 0) {
+            record_string(&station->record, p->name);
+            record_varint(&station->record, p->shed);
+        }
+    }
+    if (station->dedup != NULL) {
+        record_signed(&station->record,
+                station->duplicate - station->loggedDuplicate);
+        station->loggedDuplicate = station->duplicate;
+    }
+    if (arenaLogged) {
+        int peers = 0;
+        for (Connected *p = connected->next; p != NULL; p = p->next) {
+            peers++;
+        }
+        record_varint(&station->record, peers);
+        for (Connected *p = connected->next; p != NULL; p = p->next) {
+            record_string(&station->record, p->name);
+            record_varint(&station->record, peer_bytes(p));
+        }
+    }
+    log_record(station, EVENT_SNAPSHOT);
+    fflush(station->logFp);
+}
+
+/*
+ * given a exit Status, print the log append to the logfile
+ */
+void print_log(int exitStatus, Station *station, Connected *connected, 
+        Resource *resource) {
+    FILE *logfile = station->logFp;
+    if (station->logBinary) {
+        log_snapshot(exitStatus, station, connected);
+        return;
+    }
+    fprintf(logfile, "=======\n");
+    fprintf(logfile, "%s\n", station->name);
+    fprintf(logfile, "Processed: %d\n", station->processed);
+    fprintf(logfile, "Not mine: %d\n", station->notMine);
+    fprintf(logfile, "Format err: %d\n", station->formatErr);
+    fprintf(logfile, "No fwd: %d\n", station->noFwd);
+    if (station->rateLimit != NULL) {
+        fprintf(logfile, "Shed: %d", station->shed);
+        for (Connected *p = connected->next; p != NULL; p = p->next) {
+            if (p->shed > 0) {
+                fprintf(logfile, " %s=%d", p->name, p->shed);
+            }
+        }
+        fprintf(logfile, "\n");
+    }
+    if (station->dedup != NULL) {
+        fprintf(logfile, "Duplicate: %d\n", station->duplicate);
+    }
+    if (arenaLogged) {
+        long total = 0;
+        for (Connected *p = connected->next; p != NULL; p = p->next) {
+            total += peer_bytes(p);
+        }
+        fprintf(logfile, "Memory: %ld", total);
+        for (Connected *p = connected->next; p != NULL; p = p->next) {
+            fprintf(logfile, " %s=%ld", p->name, peer_bytes(p));
+        }
+        fprintf(logfile, "\n");
+    }
+    if (connected->next == NULL) {
+        fprintf(logfile, "NONE\n");
+    } else {
+        Connected *p = connected->next;
+        while ((p->next) != NULL) {
+            fprintf(logfile, "%s,", p->name);
+            p = p->next;
+        }
+        fprintf(logfile, "%s\n", p->name);
+    }
+    if (resource->next == NULL) {
+    } else {
+        Resource *p = resource->next;
+        while ((p->next) != NULL) {
+            fprintf(logfile, "%s %d\n", p->name, p->quantity);
+            p = p->next;
+        }
+        fprintf(logfile, "%s %d\n", p->name, p->quantity);
+    }
+    if (exitStatus == 1) {
+        fprintf(logfile, "doomtrain\n");
+    } else if (exitStatus == 2) {
+        fprintf(logfile, "stopstation\n");
+    }
+    fflush(logfile);
+}
+
+/*
+ * find the rate limit configured for peer n, falling back to the "*" entry,
+ * and fill the bucket with it. A bucket with zero rate admits everything.
+ */
+void bucket_init(Bucket *bucket, Station *station, char *n) {
+    RateLimit *found = NULL;
+    for (RateLimit *p = station->rateLimit; p != NULL; p = p->next) {
+        if (strcmp(p->name, n) == 0) {
+            found = p;
+            break;
+        } else if (strcmp(p->name, "*") == 0) {
+            found = p;
+        }
+    }
+    bucket->rate = (found == NULL) ? 0 : found->rate;
+    bucket->burst = (found == NULL) ? 0 : found->burst;
+    bucket->tokens = bucket->burst;
+    clock_gettime(CLOCK_MONOTONIC, &bucket->last);
+}
+
+/*
+ * refill the bucket for the time passed and take one token from it
+ * return 1 if a token was available, otherwise return 0
+ */
+int bucket_take(Bucket *bucket) {
+    if (bucket->rate <= 0) {
+        return 1;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double passed = (now.tv_sec - bucket->last.tv_sec) +
+            (now.tv_nsec - bucket->last.tv_nsec) / 1e9;
+    bucket->last = now;
+    bucket->tokens += passed * bucket->rate;
+    if (bucket->tokens > bucket->burst) {
+        bucket->tokens = bucket->burst;
+    }
+    if (bucket->tokens < 1) {
+        return 0;
+    }
+    bucket->tokens -= 1;
+    return 1;
+}
+
+/*
+ * interpret hot name to ip address,
+ * if cannot interpret, return NULL,
+ * otherwise, return the address pointer
+ */
+struct in_addr *name_to_ip_addr(char *hostname) {
+    int error;
+    struct addrinfo *addressInfo;
+
+    error = getaddrinfo(hostname, NULL, NULL, &addressInfo);
+    if (error) {
+        return NULL;
+    }
+    return &(((struct sockaddr_in*)(addressInfo->ai_addr))->sin_addr);
+}
+
+/*
+ * connect to the given ip address and port, return the fd
+ * or -1 if the connection failed
+ */
+int connect_to(struct in_addr *ipAddress, int port) {
+    struct sockaddr_in socketAddr;
+    int fd;
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    socketAddr.sin_family = AF_INET;
+    socketAddr.sin_port = htons(port);
+    socketAddr.sin_addr.s_addr = ipAddress->s_addr;
+    if (connect(fd, (struct sockaddr*)&socketAddr, sizeof(socketAddr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+#define MAXHOSTNAMELEN 128
+
+void *client_thread(void *arg);
+
+/*
+ * takes in a fd and get and print the binding port
+ */
+void print_port(int fd) {
+    struct sockaddr_in add;
+    socklen_t len = sizeof(add);
+    if (getsockname(fd, (struct sockaddr *)&add, &len) < 0) {
+        error(99);
+    } else {
+        printf("%d\n", ntohs(add.sin_port));
+        fflush(stdout);
+    }
+}
+
+/*
+ * start to listen to the given port and interface(if is specified)
+ */
+int open_listen(int port, int argc, char *argv[]) {
+    int fd, optVal = 1;
+    struct sockaddr_in serverAddr;
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        error(5);
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optVal, sizeof(int)) < 0) {
+        error(5);
+    }
+    if (argc == 6) {
+        struct addrinfo hints;
+        struct addrinfo *result, *rp;
+        memset(&hints, 0, sizeof(struct addrinfo));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_DGRAM;
+        hints.ai_flags = AI_PASSIVE;
+        hints.ai_protocol = 0;
+        hints.ai_canonname = NULL;
+        hints.ai_addr = NULL;
+        hints.ai_next = NULL;
+        if ((getaddrinfo(argv[5], argv[4], &hints, &result)) != 0) {
+            error(99);
+        }
+        for (rp = result; rp != NULL; rp = rp->ai_next) {
+            if (bind(fd, rp->ai_addr, rp->ai_addrlen) == 0) {
+                break;
+            }
+        }
+        if (rp == NULL) {
+            error(5);
+        }
+        freeaddrinfo(result);
+    } else {
+        serverAddr.sin_family = AF_INET;
+        serverAddr.sin_port = htons(port);
+        serverAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+        if (bind(fd, (struct sockaddr*)&serverAddr, 
+                sizeof(struct sockaddr_in)) < 0) {
+            error(5);
+        }
+    }
+    if (listen(fd, SOMAXCONN) < 0) {
+        error(5);
+    }
+    print_port(fd);
+    return fd;
+}
+
+/*
+ * idle timer callback: shut the connection down if nothing has been read
+ * from it for a full idle period, otherwise wait out the rest of the period
+ */
+void idle_fired(Timer *timer) {
+    Threadinfo *info = (Threadinfo *)timer->owner;
+    unsigned long idle = wheel.now - info->lastSeen;
+    if (idle >= info->station->idleTicks) {
+        shutdown(info->fd, SHUT_RDWR);
+    } else {
+        rearm_timer(timer, info->station->idleTicks - idle);
+    }
+}
+
+/*
+ * keepalive timer callback: mark the connection and wake the keepalive
+ * thread, which must do the sending as it needs sem
+ */
+void keepalive_fired(Timer *timer) {
+    Threadinfo *info = (Threadinfo *)timer->owner;
+    info->keepaliveDue = 1;
+    if (!__atomic_exchange_n(&keepalivePosted, 1, __ATOMIC_ACQ_REL)) {
+        sem_post(&keepaliveSem);
+    }
+    rearm_timer(timer, info->station->keepaliveTicks);
+}
+
+/*
+ * send an empty line or frame, which peers ignore but which keeps their idle timer
+ * from firing, to every connection whose keepalive timer fired. It goes
+ * through the peer's outbox under sem, so it never lands inside a train
+ * another thread is part way through writing.
+ */
+void *keepalive_thread(void *arg) {
+    while (1) {
+        if (sem_wait(&keepaliveSem) != 0) {
+            continue;
+        }
+        __atomic_store_n(&keepalivePosted, 0, __ATOMIC_RELEASE);
+        sem_wait(&sem);
+        for (Tenant *t = tenants; t != NULL; t = t->next) {
+            for (Connected *p = t->connected->next; p != NULL; p = p->next) {
+                Threadinfo *info = __atomic_load_n(&p->info,
+                        __ATOMIC_ACQUIRE);
+                if (p->peer != NULL || info == NULL ||
+                        !__atomic_exchange_n(&info->keepaliveDue, 0,
+                        __ATOMIC_ACQ_REL)) {
+                    continue;
+                }
+                /* a peer taking frames gets an empty frame instead */
+                if (p->framing) {
+                    outbox_frame(p, NULL, 0, 1);
+                } else {
+                    outbox_add(p, "\n", 1, 1);
+                }
+            }
+        }
+        flush_outboxes(0);
+        sem_post(&sem);
+    }
+    return NULL;
+}
+
+/* start the keepalive thread if STATION_KEEPALIVE is set */
+void start_keepalive(Station *station) {
+    pthread_t threadId;
+    if (station->keepaliveTicks == 0) {
+        return;
+    }
+    if (sem_init(&keepaliveSem, 0, 0) == -1 ||
+            pthread_create(&threadId, NULL, keepalive_thread, NULL) != 0) {
+        error(99);
+    }
+    pthread_detach(threadId);
+}
+
+/*
+ * start a reader thread for an established connection to station n. Needs
+ * sem, which the reader must take before it can unlink and free self and
+ * its info, so both are filled in before anyone else can see them
+ */
+void start_client_thread(int fd, Reader *reader, char *n, Connected *self,
+        Station *station, Connected *connected, Resource *resource) {
+    pthread_t threadId;
+    Threadinfo *info;
+    if((info = (Threadinfo *)malloc(sizeof(Threadinfo))) == NULL) {
+        error(99);
+    }
+    info->fd = fd;
+    info->reader = *reader;
+    info->name = n;
+    info->station = station;
+    info->connected = connected;
+    info->resource = resource;
+    info->self = self;
+    bucket_init(&info->bucket, station, n);
+    info->captureId = -1;
+    info->capture.data = NULL;
+    info->capture.length = 0;
+    info->capture.size = 0;
+    info->lastSeen = wheel.now;
+    info->idleTimer.armed = 0;
+    info->keepaliveTimer.armed = 0;
+    info->keepaliveDue = 0;
+    info->trainId = NULL;
+    if (station->idleTicks) {
+        struct timeval timeout = {station->idleTicks * WHEEL_TICK / 1000,
+                station->idleTicks * WHEEL_TICK % 1000 * 1000};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        start_timer(&info->idleTimer, station->idleTicks, idle_fired, info);
+    }
+    if (station->keepaliveTicks) {
+        start_timer(&info->keepaliveTimer, station->keepaliveTicks,
+                keepalive_fired, info);
+    }
+    __sync_fetch_and_add(&station->readers, 1);
+    pthread_create(&threadId, NULL, client_thread, (void*)(int64_t)info);
+    pthread_detach(threadId);
+    info->thread = threadId;
+    __atomic_store_n(&self->info, info, __ATOMIC_RELEASE);
+}
+
+/*
+ * set up what a station needs to take trains from co-hosted station n, the
+ * same as a reader thread's state but with no socket or thread behind it
+ */
+Threadinfo *local_info(char *n, Connected *self, Station *station,
+        Connected *connected, Resource *resource) {
+    Threadinfo *info;
+    if ((info = (Threadinfo *)calloc(1, sizeof(Threadinfo))) == NULL) {
+        error(99);
+    }
+    info->fd = -1;
+    info->name = n;
+    info->station = station;
+    info->connected = connected;
+    info->resource = resource;
+    info->self = self;
+    bucket_init(&info->bucket, station, n);
+    info->captureId = -1;
+    info->lastSeen = wheel.now;
+    return info;
+}
+
+/* return the running tenant of this process named n, or NULL */
+Tenant *find_tenant(char *n) {
+    for (Tenant *p = tenants; p != NULL; p = p->next) {
+        if (strcmp(p->station->name, n) == 0 && !p->station->stopped) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * connect the station to tenant n of this process in memory, so trains
+ * between them never touch a socket. return 1 if connected, otherwise 0
+ */
+int connect_tenant(char *n, Threadinfo *info) {
+    Tenant *tenant = find_tenant(n);
+    if (tenant == NULL || tenant->station == info->station) {
+        return 0;
+    }
+    if (has_connected(info->connected, n) ||
+            has_connected(tenant->connected, info->station->name)) {
+        error(7);
+    }
+    log_connection(info->station, EVENT_CONNECT, tenant->station->name);
+    log_connection(tenant->station, EVENT_CONNECT, info->station->name);
+    Connected *near = add_connected(info->connected, tenant->station->name,
+            -1);
+    Connected *far = add_connected(tenant->connected, info->station->name,
+            -1);
+    near->peer = far;
+    far->peer = near;
+    TRACE(connect, KIND_TENANT, near->name, -1);
+    near->info = local_info(near->name, near, info->station,
+            info->connected, info->resource);
+    far->info = local_info(far->name, far, tenant->station,
+            tenant->connected, tenant->resource);
+    if (info->station->ring != NULL) {
+        deliver(near, "%s:ring()", near->name);
+    }
+    if (tenant->station->ring != NULL) {
+        deliver(far, "%s:ring()", far->name);
+    }
+    return 1;
+}
+
+/*
+ * handle incoming connections, if connected successfully, add the station to
+ * the linked list "connected", and start a new thread to deal with it.
+ * A peer naming itself "name/tenant" is connected to that tenant.
+ */
+void process_connections(int fdServer, Station *station, Connected *connected,
+        Resource *resource) {
+    int fd;
+    struct sockaddr_in fromAddr;
+    socklen_t fromAddrSize;
+    while (1) {
+        if (station->upgrading) {
+            park_thread(station);
+            continue;
+        }
+        struct pollfd ready = {fdServer, POLLIN, 0};
+        if (ppoll(&ready, 1, NULL, &wakeMask) < 0) {
+            continue;
+        }
+        fromAddrSize = sizeof(struct sockaddr_in);
+        fd = accept(fdServer, (struct sockaddr*)&fromAddr, &fromAddrSize);
+        if (fd < 0 && errno == EINTR) {
+            continue;
+        } else if (fd < 0) {
+            error(99);
+        }
+        char *buffer = NULL;
+        Reader reader;
+        reader_init(&reader, fd, &station->upgrading);
+        Timer deadline = {0, NULL, NULL, 0, NULL, NULL};
+        if (station->handshakeTicks) {
+            start_timer(&deadline, station->handshakeTicks, shutdown_fired,
+                    (void *)(int64_t)fd);
+        }
+        char *auth = reader_line(&reader);
+        int framing = 0;
+        if (auth != NULL && strcmp(auth, FRAME_OFFER) == 0) {
+            framing = 1;
+            auth = reader_line(&reader);
+        }
+        if (auth != NULL && strcmp(auth, station->auth) == 0) {
+            buffer = reader_line(&reader);
+        }
+        cancel_timer(&deadline);
+        if (buffer == NULL || strlen(buffer) == 0) {
+            arena_release(&reader.arena);
+            close(fd);
+            continue;
+        }
+        buffer = arena_strdup(&reader.arena, buffer);
+        char *slash = strchr(buffer, '/');
+        if (slash != NULL) {
+            *slash = '\0';
+        }
+        /*
+         * the tenant list never changes once running, and the reply must not
+         * wait for the lock: a dialing station holds its own lock until
+         * it is answered
+         */
+        Tenant *tenant = find_tenant((slash != NULL) ? slash + 1 :
+                station->name);
+        if (tenant != NULL) {
+            dprintf(fd, "%s\n", tenant->station->name);
+        }
+        sem_wait(&sem);
+        if (tenant == NULL || tenant->station->stopped ||
+                (tenant->station->peered && settle_duplicate(
+                tenant->connected, tenant->station, buffer, 0))) {
+            sem_post(&sem);
+            arena_release(&reader.arena);
+            close(fd);
+            continue;
+        }
+        Connected *self = process_station(tenant->connected, tenant->station,
+                buffer, fd, framing);
+        TRACE(connect, KIND_ACCEPTED, buffer, fd);
+        start_client_thread(fd, &reader, buffer, self, tenant->station,
+                tenant->connected, tenant->resource);
+        sem_post(&sem);
+    }
+}
+
+/*
+ * handle doomtrain, sent doomtrain to all connected stations
+ */
+void process_doom_train(char *str, Threadinfo *info) {
+    if ((info->connected->next) != NULL) {
+        Connected *p = info->connected->next;
+        while ((p->next) != NULL) {
+            deliver(p, "%s:doomtrain", p->name);
+            p = p->next;
+        }
+        deliver(p, "%s:doomtrain", p->name);
+    }
+}
+
+/*
+ * check one add-train entry of length characters: port@host, optionally
+ * naming a tenant as port@host/tenant, or just a tenant's name when this
+ * process hosts tenants. return 0 if the format is invalid otherwise return 1
+ */
+int add_entry_validation(char *entry, size_t length) {
+    char *end = entry + length;
+    char *at = memchr(entry, '@', length);
+    char *slash = memchr(entry, '/', length);
+    if (length == 0) {
+        return 0;
+    }
+    if (at == NULL) {
+        return tenants->next != NULL && slash == NULL;
+    }
+    if (at == entry || strspn(entry, "0123456789") != at - entry ||
+            at + 1 == end || at + 1 == slash ||
+            memchr(at + 1, '@', end - at - 1) != NULL) {
+        return 0;
+    }
+    if (slash != NULL && (slash + 1 == end ||
+            memchr(slash + 1, '/', end - slash - 1) != NULL)) {
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * check add-train's format. return 0 if the format is invalid
+ * otherwise return 1
+ */
+int add_train_validation(char *str) {
+    char *entry = str;
+    while (1) {
+        size_t length = strcspn(entry, ",");
+        if (add_entry_validation(entry, length) == 0) {
+            return 0;
+        }
+        if (entry[length] == '\0') {
+            return 1;
+        }
+        entry += length + 1;
+    }
+}
+
+/*
+ * connect to the station with given hostname and port and exchange auth and
+ * names with it, without touching the shared station state, offering
+ * frames if the station is set to. return the fd and set up reader, name
+ * (kept in the reader's arena) and framing, or return -1 if it failed
+ */
+int dial_station(char *hostname, int port, char *tenant, Station *station,
+        Reader *reader, char **name, int *framing) {
+    struct in_addr *ipAddress = name_to_ip_addr(hostname);
+    if (ipAddress == NULL) {
+        return -1;
+    }
+    /* a station without framing hangs up on the offer, so ask again */
+    for (*framing = station->framing; ; *framing = 0) {
+        int fd;
+        if ((fd = connect_to(ipAddress, port)) < 0) {
+            return -1;
+        }
+        dprintf(fd, "%s%s%s\n%s%s%s\n", (*framing) ? FRAME_OFFER : "",
+                (*framing) ? "\n" : "", station->auth, station->name,
+                (tenant != NULL) ? "/" : "", (tenant != NULL) ? tenant : "");
+        reader_init(reader, fd, &station->upgrading);
+        Timer deadline = {0, NULL, NULL, 0, NULL, NULL};
+        if (station->handshakeTicks) {
+            start_timer(&deadline, station->handshakeTicks, shutdown_fired,
+                    (void *)(int64_t)fd);
+        }
+        *name = reader_line(reader);
+        cancel_timer(&deadline);
+        if (*name != NULL) {
+            *name = arena_strdup(&reader->arena, *name);
+            return fd;
+        }
+        arena_release(&reader->arena);
+        close(fd);
+        if (*framing == 0) {
+            return -1;
+        }
+    }
+}
+
+/*
+ * connect to the station with given hostname and port, or to its tenant
+ * if tenant is not NULL
+ * return 1 if added successfully, otherwise return 0
+ */
+int connect_station(char *hostname, int port, char *tenant,
+        Threadinfo *info) {
+    Reader reader;
+    char *buffer;
+    int framing;
+    int fd = dial_station(hostname, port, tenant, info->station, &reader,
+            &buffer, &framing);
+    if (fd < 0) {
+        return 0;
+    }
+    Connected *self = process_station(info->connected, info->station, buffer,
+            fd, framing);
+    self->dialed = 1;
+    TRACE(connect, KIND_DIALED, buffer, fd);
+    start_client_thread(fd, &reader, buffer, self, info->station,
+            info->connected, info->resource);
+    return 1;
+}
+
+/*
+ * connect to one checked add-train entry, a co-hosted tenant if it has no
+ * '@'. return 1 if added successfully, otherwise return 0
+ */
+int add_station(char *entry, Threadinfo *info) {
+    char *host = strchr(entry, '@');
+    if (host == NULL) {
+        return connect_tenant(entry, info);
+    }
+    *host++ = '\0';
+    char *tenant = strchr(host, '/');
+    if (tenant != NULL) {
+        *tenant++ = '\0';
+    }
+    return connect_station(host, atoi(entry), tenant, info);
+}
+
+/*
+ * handle add train, check format first and then connect them
+ */
+int process_add_train(char *str, Threadinfo *info) {
+    if (strchr(str, ')') == 0 || *(strchr(str, ')') + 1) != '\0') {
+        count(&info->station->formatErr);
+        return 0;
+    }
     str = str + 4;
     *(strchr(str, ')')) = '\0';
     if (add_train_validation(str) == 0) {
-        (info->station->formatErr)++;
+        count(&info->station->formatErr);
+        return 0;
+    }
+    int stationNumber = 0;
+    for (char *p = str; *p != '\0'; p++) {
+        if (*p == ',') {
+            stationNumber++;
+        }
+    }
+    char *p = str;
+    char *next = NULL;
+    /* a failed connection ends the process, send what is queued first */
+    flush_outboxes(1);
+    for (int i = 0; i < stationNumber; i++) {
+        next = strchr(p, ',') + 1;
+        *(strchr(p, ',')) = '\0';
+        if (add_station(p, info) != 1) {
+            error(6);
+        }
+        p = next;
+    }
+    if (add_station(p, info) != 1) {
+        error(6);
+    }
+    return 1;
+}
+
+/* compare two ring points by hash, then by member, for qsort */
+int compare_points(const void *a, const void *b) {
+    const RingPoint *p = (const RingPoint *)a, *q = (const RingPoint *)b;
+    if (p->hash != q->hash) {
+        return (p->hash < q->hash) ? -1 : 1;
+    }
+    return p->member - q->member;
+}
+
+/*
+ * rebuild the ring from the connected stations that sent ring(), with
+ * this station's own points only if "self" is set. Each member's points
+ * depend on its name alone, so a member joining or leaving only moves
+ * the names that land on its own points.
+ */
+void ring_build(Station *station, Connected *connected, int self) {
+    Ring *ring = station->ring;
+    int memberNumber = 1;
+    for (Connected *p = connected->next; p != NULL; p = p->next) {
+        memberNumber += p->ring;
+    }
+    if ((ring->members = (char **)realloc(ring->members,
+            sizeof(char *) * memberNumber)) == NULL ||
+            (ring->circle = (RingPoint *)realloc(ring->circle,
+            sizeof(RingPoint) * memberNumber * ring->points)) == NULL ||
+            (ring->batches = (FILE **)realloc(ring->batches,
+            sizeof(FILE *) * memberNumber)) == NULL ||
+            (ring->texts = (char **)realloc(ring->texts,
+            sizeof(char *) * memberNumber)) == NULL ||
+            (ring->sizes = (size_t *)realloc(ring->sizes,
+            sizeof(size_t) * memberNumber)) == NULL) {
+        error(99);
+    }
+    ring->members[0] = station->name;
+    ring->memberNumber = 1;
+    for (Connected *p = connected->next; p != NULL; p = p->next) {
+        if (p->ring) {
+            ring->members[ring->memberNumber++] = p->name;
+        }
+    }
+    ring->pointNumber = 0;
+    for (int i = (self) ? 0 : 1; i < ring->memberNumber; i++) {
+        uint64_t hash = hash_string(ring->members[i]);
+        for (int j = 0; j < ring->points; j++) {
+            uint64_t point = hash + j * 0x9e3779b97f4a7c15ULL;
+            point = (point ^ (point >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            point = (point ^ (point >> 27)) * 0x94d049bb133111ebULL;
+            ring->circle[ring->pointNumber].hash = point ^ (point >> 31);
+            ring->circle[ring->pointNumber++].member = i;
+        }
+    }
+    qsort(ring->circle, ring->pointNumber, sizeof(RingPoint), compare_points);
+    for (int i = 0; i < ring->memberNumber; i++) {
+        ring->batches[i] = NULL;
+    }
+}
+
+/*
+ * return the ring member owning resource n, the first point clockwise from
+ * n's hash, or 0 (this station) if the ring is empty
+ */
+int ring_owner(Ring *ring, char *n) {
+    if (ring->pointNumber == 0) {
+        return 0;
+    }
+    uint64_t hash = hash_string(n);
+    int low = 0, high = ring->pointNumber;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (ring->circle[middle].hash < hash) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return ring->circle[(low == ring->pointNumber) ? 0 : low].member;
+}
+
+/* queue q of resource n for the ring member owning it */
+void ring_queue(Ring *ring, int member, char *n, int q) {
+    if (ring->batches[member] == NULL) {
+        if ((ring->batches[member] = open_memstream(&ring->texts[member],
+                &ring->sizes[member])) == NULL) {
+            error(99);
+        }
+        fprintf(ring->batches[member], "%s:own(", ring->members[member]);
+    } else {
+        fputc(',', ring->batches[member]);
+    }
+    fprintf(ring->batches[member], "%s%c%d", n, (q < 0) ? '-' : '+',
+            (q < 0) ? -q : q);
+}
+
+/* send every queued batch to its member as one own() train */
+void ring_flush(Station *station, Connected *connected) {
+    Ring *ring = station->ring;
+    for (int i = 1; i < ring->memberNumber; i++) {
+        if (ring->batches[i] == NULL) {
+            continue;
+        }
+        fputc(')', ring->batches[i]);
+        fclose(ring->batches[i]);
+        ring->batches[i] = NULL;
+        Connected *p = get_connected(connected, ring->members[i]);
+        if (p != NULL) {
+            deliver(p, "%s", ring->texts[i]);
+        } else {
+            (station->noFwd)++;
+        }
+        free(ring->texts[i]);
+    }
+}
+
+/*
+ * after the ring changed, send every resource this station holds but no
+ * longer owns to its owner, so only the keys whose owner changed move
+ */
+void ring_move(Station *station, Connected *connected, Resource *head) {
+    Ring *ring = station->ring;
+    for (Resource *p = head->next; p != NULL; p = p->next) {
+        int owner;
+        if (p->quantity != 0 && (owner = ring_owner(ring, p->name)) != 0) {
+            ring_queue(ring, owner, p->name, p->quantity);
+            log_delta(station, p, -p->quantity);
+            p->quantity = 0;
+        }
+    }
+    ring_flush(station, connected);
+}
+
+/*
+ * handle "ring()": the peer takes part in the ring, so add its points and
+ * hand it the resources that now land on them
+ */
+void process_ring_train(Threadinfo *info) {
+    Station *station = info->station;
+    if (station->ring == NULL || info->self->ring) {
+        return;
+    }
+    info->self->ring = 1;
+    ring_build(station, info->connected, 1);
+    ring_move(station, info->connected, info->resource);
+}
+
+/*
+ * check resource train's format. return 0 if the format is invalid
+ * otherwise return 1
+ */
+int resource_train_validation(char *str) {
+    int isDigit = 0;
+    int operator = 0;
+    int comma = 0;
+    int count = 0;
+    char *p = str;
+    if (*p == '+' || *p == '-' || *p == ',') {
+        return 0;
+    }
+    for (; *p != '\0'; p++) {
+        if (*p == '+' || *p == '-') {
+            if (count == 0) {
+                return 0;
+            }
+            count = 0;
+            isDigit = 1;
+            operator++;
+        } else if (*p == ',') {
+            if (count == 0) {
+                return 0;
+            }
+            count = 0;
+            isDigit = 0;
+            if (operator == 0) {
+                return 0;
+            }
+            comma++;
+        } else {
+            if (isDigit == 1 && (*p < '0' || *p > '9')) {
+                return 0;
+            }
+            count++;
+        }
+    }
+    if (operator - comma != 1) {
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * load or unload q of resource n here, or with a ring, queue it for the
+ * member owning n unless the train was already sent to its owner ("mine")
+ */
+void load_resource(Threadinfo *info, char *n, int q, int mine) {
+    Ring *ring = info->station->ring;
+    int owner;
+    if (ring != NULL && !mine && (owner = ring_owner(ring, n)) != 0) {
+        ring_queue(ring, owner, n, q);
+        return;
+    }
+    Resource *node = process_resource(info->station, info->resource, n, q);
+    log_delta(info->station, node, q);
+}
+
+/*
+ * handle resource train, check format first and then load/unlload them
+ */
+int process_resource_train(char *str, Threadinfo *info, int mine) {
+    if (resource_train_validation(str) == 0) {
+        count(&info->station->formatErr);
+        return 0;
+    }
+    int resourceNumber = 0;
+    for (char *p = str; *p != '\0'; p++) {
+        if (*p == ',') {
+            resourceNumber++;
+        }
+    }
+
+    char *p = str;
+    char *next = NULL;
+    for (int i = 0; i < resourceNumber; i++) {
+        next = strchr(p, ',') + 1;
+        *(strchr(p, ',')) = '\0';
+        char operator = (strchr(p, '+') != 0) ? '+' : '-';
+        char *number = NULL;
+        char *name = p;
+        number = strchr(p, operator) + 1;
+        *(strchr(p, operator)) = '\0';
+        int quantity = (operator == '+') ? atoi(number) : (0 - atoi(number));
+        load_resource(info, name, quantity, mine);
+        p = next;
+    }
+    char operator = (strchr(p, '+') != 0) ? '+' : '-';
+    char *number = NULL;
+    char *name = p;
+    number = strchr(p, operator) + 1;
+    *(strchr(p, operator)) = '\0';
+    int quantity = (operator == '+') ? atoi(number) : (0 - atoi(number));
+    load_resource(info, name, quantity, mine);
+    if (info->station->ring != NULL) {
+        ring_flush(info->station, info->connected);
+    }
+    TRACE(apply, mine ? KIND_OWN : KIND_RESOURCE, info->name,
+            resourceNumber + 1);
+    return 1;
+}
+
+/*
+ * handle "own(cargo)": resources another ring member found to be this
+ * station's, loaded here without looking at the ring again so a train
+ * never bounces between stations whose rings differ.
+ * return 0 if the format is invalid, otherwise return 1
+ */
+int process_own_train(char *str, Threadinfo *info) {
+    char *end = str + strlen(str) - 1;
+    if (*end != ')') {
+        count(&info->station->formatErr);
+        return 0;
+    }
+    *end = '\0';
+    return process_resource_train(str + 4, info, 1);
+}
+
+void process_fwd(char *str, Threadinfo *info);
+void drain_local(void);
+
+/*
+ * handle route registration "route(name,hop,...)": remember the first hop
+ * as this station's next hop on route name and pass the rest of the hops
+ * on to it. return 0 if the format is invalid, otherwise return 1
+ */
+int process_route_train(char *str, Threadinfo *info) {
+    char *end = strchr(str, ')');
+    if (end == NULL || *(end + 1) != '\0') {
+        count(&info->station->formatErr);
+        return 0;
+    }
+    str = str + 6;
+    *end = '\0';
+    if (*str == '\0' || *str == ',' || *(end - 1) == ',' ||
+            strstr(str, ",,") != NULL || strchr(str, '(') != NULL) {
+        count(&info->station->formatErr);
+        return 0;
+    }
+    char *hop = strchr(str, ',');
+    if (hop == NULL) {
+        set_route(info->station, str, NULL);
+        return 1;
+    }
+    *hop++ = '\0';
+    char *rest = strchr(hop, ',');
+    if (rest != NULL) {
+        *rest++ = '\0';
+    }
+    set_route(info->station, str, hop);
+    char *train = (char *)scratch_alloc(sizeof(char) * (strlen(hop) +
+            strlen(str) + (rest ? strlen(rest) : 0) + 10));
+    sprintf(train, "%s:route(%s%s%s)", hop, str, rest ? "," : "",
+            rest ? rest : "");
+    process_fwd(train, info);
+    scratch_free(train);
+    return 1;
+}
+
+/*
+ * forward the cargo left in a train on route name to this station's next
+ * hop on that route
+ */
+void process_route_fwd(char *name, char *str, Threadinfo *info) {
+    Route *route = get_route(info->station, name);
+    Connected *p;
+    if (route == NULL || route->hop == NULL ||
+            (p = get_connected(info->connected, route->hop)) == NULL) {
+        (info->station->noFwd)++;
+        return;
+    }
+    TRACE(forward, KIND_ROUTE, p->name, strlen(str));
+    if (info->trainId != NULL) {
+        deliver(p, "%s:#%s:@%s:%s", route->hop, info->trainId, name, str);
+    } else {
+        deliver(p, "%s:@%s:%s", route->hop, name, str);
+    }
+}
+
+/*
+ * send the train made from format to connected station n
+ * return 0 if n is not connected, otherwise return 1
+ */
+int send_train(Connected *head, char *n, const char *format, ...) {
+    Connected *p = get_connected(head, n);
+    if (p == NULL) {
+        return 0;
+    }
+    va_list args;
+    va_start(args, format);
+    char *text = scratch_vprintf(format, args);
+    va_end(args);
+    deliver(p, "%s:%s", n, text);
+    scratch_free(text);
+    return 1;
+}
+
+/*
+ * handle "get(name,...)": answer the current quantity of every named
+ * resource (0 if this station does not hold it) in one "got(name=quantity,
+ * ...)" train, sent back to the asking peer or, if the train goes on,
+ * carried as the last cargo of the rest of the train. A station sent the
+ * answer back takes it as processed, so a station asking needs the second
+ * form to see it.
+ * return 0 if the format is invalid, otherwise return 1
+ */
+int process_get_train(char *str, char *next, Threadinfo *info) {
+    char *end = str + strlen(str) - 1;
+    if (*end != ')' || end == str + 4 || *(str + 4) == ',' ||
+            *(end - 1) == ',' || strstr(str, ",,") != NULL) {
+        count(&info->station->formatErr);
+        return 0;
+    }
+    *end = '\0';
+    char *text = NULL;
+    size_t size = 0;
+    FILE *reply = open_memstream(&text, &size);
+    if (reply == NULL) {
+        error(99);
+    }
+    if (next != NULL) {
+        fprintf(reply, "%s:", next);
+    }
+    fprintf(reply, "got(");
+    for (char *name = str + 4, *comma; name != NULL; name = comma) {
+        if ((comma = strchr(name, ',')) != NULL) {
+            *comma++ = '\0';
+        }
+        Resource *node = find_resource(info->station, name);
+        fprintf(reply, "%s=%d%s", name, (node != NULL) ? node->quantity : 0,
+                (comma != NULL) ? "," : ")");
+    }
+    fclose(reply);
+    if (next != NULL) {
+        process_fwd(text, info);
+    } else {
+        send_train(info->connected, info->name, "%s", text);
+    }
+    free(text);
+    return 1;
+}
+
+/* return the query with id, or NULL if this station has not seen it */
+Query *get_query(Station *station, char *id) {
+    for (Query *p = station->queries; p != NULL; p = p->next) {
+        if (strcmp(p->id, id) == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * send the query's totals to whoever asked and stop waiting for the rest,
+ * marking them partial if some neighbour has not answered. Called with sem
+ * held
+ */
+void finish_query(Query *query) {
+    if (query->waiting < 0) {
+        return;
+    }
+    if (query->waiting > 0) {
+        query->partial = 1;
+    }
+    cancel_timer(&query->deadline);
+    query->waiting = -1;
+    query->finished = wheel.now;
+    if (query->origin) {
+        send_train(query->connected, query->reply,
+                "sum(%s)=%ld,%ld,%ld,%ld%s", query->target, query->sum,
+                query->resources, query->stations, query->depth,
+                query->partial ? ",partial" : "");
+    } else {
+        send_train(query->connected, query->reply,
+                "answer(%s,%ld,%ld,%ld,%ld,%d)", query->id, query->sum,
+                query->resources, query->stations, query->depth,
+                query->partial);
+    }
+}
+
+/*
+ * answer every query whose deadline passed with what has arrived so far,
+ * each time a deadline wakes this thread
+ */
+void *query_thread(void *arg) {
+    while (1) {
+        if (sem_wait(&querySem) != 0) {
+            continue;
+        }
+        __atomic_store_n(&queryPosted, 0, __ATOMIC_RELEASE);
+        sem_wait(&sem);
+        for (Tenant *t = tenants; t != NULL; t = t->next) {
+            for (Query *p = t->station->queries; p != NULL; p = p->next) {
+                if (__atomic_exchange_n(&p->expired, 0, __ATOMIC_ACQ_REL)) {
+                    finish_query(p);
+                }
+            }
+        }
+        drain_local();
+        flush_outboxes(0);
+        sem_post(&sem);
+    }
+    return NULL;
+}
+
+/*
+ * timer callback for a query deadline: mark the query and wake the query
+ * thread, as the callback must not block on sem
+ */
+void query_fired(Timer *timer) {
+    Query *query = (Query *)timer->owner;
+    __atomic_store_n(&query->expired, 1, __ATOMIC_RELEASE);
+    if (!__atomic_exchange_n(&queryPosted, 1, __ATOMIC_ACQ_REL)) {
+        sem_post(&querySem);
+    }
+}
+
+/* start the thread answering queries whose deadline passed */
+void start_queries(void) {
+    pthread_t threadId;
+    if (sem_init(&querySem, 0, 0) == -1 ||
+            pthread_create(&threadId, NULL, query_thread, NULL) != 0) {
+        error(99);
+    }
+    pthread_detach(threadId);
+}
+
+/*
+ * take part in query id for target: add up the matching resources here and
+ * pass the query on to every neighbour except "from", who get two ticks
+ * less than this station so that they answer before it gives up on them.
+ * Queries answered long ago are forgotten first.
+ */
+void start_query(Threadinfo *info, char *id, char *target, char *from,
+        int origin, unsigned long ticks) {
+    Station *station = info->station;
+    Query **pre = &station->queries;
+    while (*pre != NULL) {
+        Query *p = *pre;
+        if (p->waiting < 0 && wheel.now - p->finished >
+                2 * station->queryTicks) {
+            *pre = p->next;
+            free(p->id);
+            free(p->target);
+            free(p->reply);
+            free(p);
+        } else {
+            pre = &p->next;
+        }
+    }
+    Query *query;
+    if ((query = (Query *)malloc(sizeof(Query))) == NULL ||
+            (query->id = strdup(id)) == NULL ||
+            (query->target = strdup(target)) == NULL ||
+            (query->reply = strdup(from)) == NULL) {
+        error(99);
+    }
+    query->origin = origin;
+    query->sum = 0;
+    query->resources = 0;
+    query->stations = 1;
+    query->depth = 0;
+    query->partial = 0;
+    query->expired = 0;
+    query->station = station;
+    query->connected = info->connected;
+    query->deadline.armed = 0;
+    query->next = station->queries;
+    station->queries = query;
+    size_t length = strlen(target);
+    int prefix = (length > 0 && target[length - 1] == '*');
+    for (Resource *p = info->resource->next; p != NULL; p = p->next) {
+        if ((prefix && strncmp(p->name, target, length - 1) == 0) ||
+                (!prefix && strcmp(p->name, target) == 0)) {
+            query->sum += p->quantity;
+            query->resources++;
+        }
+    }
+    query->waiting = 0;
+    for (Connected *p = info->connected->next; p != NULL; p = p->next) {
+        if (strcmp(p->name, from) != 0 && send_train(info->connected,
+                p->name, "query(%s,%lu,%s)", id,
+                ((ticks > 2) ? ticks - 2 : 1) * WHEEL_TICK, target)) {
+            query->waiting++;
+        }
+    }
+    if (query->waiting == 0) {
+        finish_query(query);
+    } else {
+        start_timer(&query->deadline, ticks, query_fired, query);
+    }
+}
+
+/*
+ * handle the query trains. "sum(target)" from any peer starts a query here
+ * (and "sum(target)=..." is its answer, which a station asking just takes),
+ * "query(id,ms,target)" from a station joins one with ms to answer in (a
+ * query seen before answers 0 at once, which stops cycles) and
+ * "answer(id,sum,resources,stations,depth[,partial])" is a neighbour's
+ * total, where depth is how many hops below it the furthest answer came
+ * from and partial is 1 if some station below it did not answer in time.
+ * return 0 if the format is invalid, otherwise return 1
+ */
+int process_query_train(char *str, Threadinfo *info) {
+    Station *station = info->station;
+    /* a sum() answer sent back to this station, it ends here */
+    if (strstr(str, "sum(") == str && strstr(str, ")=") != NULL) {
+        return 1;
+    }
+    char *open = strchr(str, '(');
+    char *end = str + strlen(str) - 1;
+    if (*end != ')' || end == open + 1) {
+        count(&station->formatErr);
+        return 0;
+    }
+    *end = '\0';
+    if (strstr(str, "sum(") == str) {
+        char id[64];
+        sprintf(id, "%lx.%lx.%lx", (unsigned long)hash_string(station->name),
+                (unsigned long)time(NULL), ++station->queryNumber);
+        start_query(info, id, open + 1, info->name, 1, station->queryTicks);
+        return 1;
+    }
+    char *id = open + 1;
+    char *field = strchr(id, ',');
+    char *last;
+    if (field == NULL || field == id) {
+        count(&station->formatErr);
+        return 0;
+    }
+    *field++ = '\0';
+    if (strstr(str, "query(") == str) {
+        unsigned long ms = strtoul(field, &last, 10);
+        if (last == field || *last != ',' || *(last + 1) == '\0') {
+            count(&station->formatErr);
+            return 0;
+        }
+        if (get_query(station, id) != NULL) {
+            send_train(info->connected, info->name, "answer(%s,0,0,0,0)",
+                    id);
+        } else {
+            start_query(info, id, last + 1, info->name, 0,
+                    (ms + WHEEL_TICK - 1) / WHEEL_TICK);
+        }
+        return 1;
+    }
+    long totals[5] = {0, 0, 0, 0, 0};
+    for (int i = 0; i < 5; i++) {
+        totals[i] = strtol(field, &last, 10);
+        if (last == field || !((*last == ',' && i < 4) ||
+                (*last == '\0' && i >= 3))) {
+            count(&station->formatErr);
+            return 0;
+        }
+        if (*last == '\0') {
+            break;
+        }
+        field = last + 1;
+    }
+    Query *query = get_query(station, id);
+    if (query != NULL && query->waiting > 0) {
+        query->sum += totals[0];
+        query->resources += totals[1];
+        query->stations += totals[2];
+        if (totals[2] > 0 && totals[3] + 1 > query->depth) {
+            query->depth = totals[3] + 1;
+        }
+        if (totals[4] != 0) {
+            query->partial = 1;
+        }
+        if (--query->waiting == 0) {
+            finish_query(query);
+        }
+    }
+    return 1;
+}
+
+/*
+ * forward each branch of a multicast train "[B:...|C:...]" to its own
+ * neighbour. Branches may hold further trees, so only a '|' outside any
+ * nested brackets splits them. An unbalanced tree counts as one no fwd.
+ */
+void process_branches(char *str, Threadinfo *info) {
+    int depth = 0;
+    char *p;
+    for (p = str; *p != '\0'; p++) {
+        if (*p == '[') {
+            depth++;
+        } else if (*p == ']' && --depth == 0 && *(p + 1) != '\0') {
+            break;
+        }
+    }
+    if (depth != 0 || *p != '\0') {
+        (info->station->noFwd)++;
+        return;
+    }
+    *(p - 1) = '\0';
+    char *branch = str + 1;
+    for (p = branch; ; p++) {
+        if (*p == '[') {
+            depth++;
+        } else if (*p == ']') {
+            depth--;
+        } else if ((*p == '|' && depth == 0) || *p == '\0') {
+            char end = *p;
+            *p = '\0';
+            process_fwd(branch, info);
+            if (end == '\0') {
+                break;
+            }
+            branch = p + 1;
+        }
+    }
+}
+
+/*
+ * queue the rest of a text train, from its next station at str on, for peer
+ * socket p. Most of it is the reader's own buffer, sent from where it lies
+ * with the train ID put back after the next station's name at colon
+ */
+void forward_line(Connected *p, char *str, char *colon, Threadinfo *info) {
+    int stable = in_reader(info, str);
+    if (info->trainId != NULL) {
+        outbox_add(p, str, colon - str + 1, stable);
+        outbox_add(p, "#", 1, 1);
+        outbox_add(p, info->trainId, strlen(info->trainId),
+                in_reader(info, info->trainId));
+        outbox_add(p, colon, strlen(colon), stable);
+    } else {
+        outbox_add(p, str, strlen(str), stable);
+    }
+    outbox_add(p, "\n", 1, 1);
+}
+
+/*
+ * forward the string to other stations, or each of its branches if it
+ * is a multicast tree
+ */
+void process_fwd(char *str, Threadinfo *info) {
+    if (*str == '[') {
+        process_branches(str, info);
+    } else if (strchr(str, ':')) {
+        char *p = strchr(str, ':');
+        *p = '\0';
+        Connected *node = get_connected(info->connected, str);
+        if (node != NULL) {
+            *p = ':';
+            TRACE(forward, KIND_TEXT, node->name, strlen(str));
+            if (node->peer == NULL && !node->framing) {
+                forward_line(node, str, p, info);
+            } else if (info->trainId != NULL) {
+                deliver(node, "%.*s:#%s%s", (int)(p - str), str,
+                        info->trainId, p);
+            } else {
+                deliver(node, "%s", str);
+            }
+        } else {
+            (info->station->noFwd)++;
+            return;
+        }
+    } else {
+        (info->station->noFwd)++;
+        return;
+    }
+}
+
+/* return the KIND_ of cargo str for tracepoints, by how it starts */
+int train_kind(char *str) {
+    if (strcmp(str, "doomtrain") == 0) {
+        return KIND_DOOM;
+    } else if (strcmp(str, "stopstation") == 0) {
+        return KIND_STOP;
+    } else if (strstr(str, "add(") == str) {
+        return KIND_ADD;
+    } else if (strstr(str, "sum(") == str || strstr(str, "query(") == str ||
+            strstr(str, "answer(") == str) {
+        return KIND_QUERY;
+    } else if (strstr(str, "get(") == str) {
+        return KIND_GET;
+    } else if (strstr(str, "route(") == str) {
+        return KIND_ROUTE;
+    } else if (strcmp(str, "ring()") == 0) {
+        return KIND_RING;
+    } else if (strstr(str, "own(") == str) {
+        return KIND_OWN;
+    } else if (strchr(str, '+') || strchr(str, '-')) {
+        return KIND_RESOURCE;
+    }
+    return KIND_INVALID;
+}
+
+/*
+ * cut the first cargo of str off the rest of the train, return the rest or
+ * NULL if there is none
+ */
+char *split_cargo(char *str) {
+    char *next = strchr(str, ':');
+    if (next != NULL) {
+        *next++ = '\0';
+    }
+    return next;
+}
+
+/*
+ * end the station after a doomtrain (exitStatus 1) or stopstation (2).
+ * A doomtrain ends the process and every tenant in it, a stopstation only
+ * ends this tenant and its connections unless it is the last one running
+ */
+void stop_station(int exitStatus, Threadinfo *info) {
+    Station *station = info->station;
+    int running = 0;
+    flush_outboxes(1);
+    print_log(exitStatus, station, info->connected, info->resource);
+    station->stopped = 1;
+    for (Tenant *p = tenants; p != NULL; p = p->next) {
+        running += !p->station->stopped;
+    }
+    if (exitStatus == 1 || running == 0) {
+        for (Tenant *p = tenants; p != NULL; p = p->next) {
+            if (!p->station->stopped) {
+                print_log(exitStatus, p->station, p->connected, p->resource);
+            }
+        }
+        exit(0);
+    }
+    for (Connected *p = info->connected->next; p != NULL; p = p->next) {
+        if (p->peer == NULL) {
+            shutdown(p->fd, SHUT_RDWR);
+            continue;
+        }
+        Threadinfo *other = p->peer->info;
+        TRACE(disconnect, KIND_TENANT, p->name, -1);
+        remove_connected(other->connected, station->name);
+        log_connection(other->station, EVENT_DISCONNECT, station->name);
+        if (other->station->ring != NULL && p->peer->ring) {
+            ring_build(other->station, other->connected, 1);
+        }
+    }
+}
+
+/*
+ * main function to process a train string,
+ * check the category of the train and handle it using
+ * corresponding functions.
+ */
+void process_train(char *buffer, Threadinfo *info) {
+    if (strchr(buffer, ':') == 0) {
+        count(&info->station->formatErr);
+        return;
+    }
+    if (strstr(buffer, info->station->name) == buffer && 
+            *(buffer + strlen(info->station->name)) == ':') {
+        char *current = buffer + strlen(info->station->name) + 1;
+        char *next = NULL;
+        if (strlen(current) == 0) {
+            count(&info->station->formatErr);
+            return;
+        } else {
+            next = split_cargo(current);
+            /* "#id:..." names the train, so a resent copy is applied once */
+            info->trainId = NULL;
+            if (*current == '#' && *(current + 1) != '\0' &&
+                    next != NULL) {
+                info->trainId = current + 1;
+                current = next;
+                next = split_cargo(current);
+            }
+            /* "@name:cargo:cargo..." follows registered route name */
+            char *route = NULL;
+            if (*current == '@' && next != NULL) {
+                route = current + 1;
+                current = next;
+                next = split_cargo(current);
+            }
+            TRACE(parse, train_kind(current), info->name, strlen(current));
+            int fwdStatus = 0, exitStatus = 0;
+            if (info->trainId != NULL &&
+                    dedup_seen(info->station, info->trainId)) {
+                (info->station->duplicate)++;
+                fwdStatus = 1;
+            } else if (strcmp(current, "doomtrain") == 0) {
+                process_doom_train(current, info);
+                (info->station->processed)++;
+                exitStatus = 1;
+            } else if (strcmp(current, "stopstation") == 0) {
+                /* hand this station's share of the ring to the others */
+                if (info->station->ring != NULL) {
+                    ring_build(info->station, info->connected, 0);
+                    ring_move(info->station, info->connected,
+                            info->resource);
+                }
+                (info->station->processed)++;
+                fwdStatus = 1;
+                exitStatus = 2;
+            } else if (strstr(current, "add(") == current) {
+                if ((fwdStatus = process_add_train(current, info)) == 1) {
+                    (info->station->processed)++;
+                }
+            } else if ((strstr(current, "sum(") == current ||
+                    strstr(current, "query(") == current ||
+                    strstr(current, "answer(") == current) && next == NULL) {
+                if (process_query_train(current, info) == 1) {
+                    (info->station->processed)++;
+                }
+            } else if (strstr(current, "get(") == current && route == NULL) {
+                if (process_get_train(current, next, info) == 1) {
+                    (info->station->processed)++;
+                }
+            } else if (strstr(current, "got(") == current && next == NULL &&
+                    current[strlen(current) - 1] == ')') {
+                /* a get() answer sent back to this station, it ends here */
+                (info->station->processed)++;
+            } else if (strstr(current, "route(") == current &&
+                    route == NULL && next == NULL) {
+                if (process_route_train(current, info) == 1) {
+                    (info->station->processed)++;
+                }
+            } else if (strcmp(current, "ring()") == 0 && route == NULL &&
+                    next == NULL) {
+                process_ring_train(info);
+                (info->station->processed)++;
+            } else if (strstr(current, "own(") == current && route == NULL &&
+                    next == NULL) {
+                if (process_own_train(current, info) == 1) {
+                    (info->station->processed)++;
+                }
+            } else if (strchr(current, '+') || strchr(current, '-')) {
+                if ((fwdStatus = process_resource_train(current, info,
+                        0)) == 1) {
+                    (info->station->processed)++;
+                }
+            } else {
+                count(&info->station->formatErr);
+                return;
+            }
+            if (next != NULL && fwdStatus && route != NULL) {
+                process_route_fwd(route, next, info);
+            } else if (next != NULL && fwdStatus) {
+                process_fwd(next, info);
+            }
+            if (exitStatus) {
+                stop_station(exitStatus, info);
+            }
+        }
+    } else {
+        count(&info->station->notMine);
+    }
+}
+
+/*
+ * pass the rest of a framed train, from its next station on, to connected
+ * station p: as the same bytes, queued in its outbox, if p takes frames,
+ * otherwise as text
+ */
+void forward_frame(Connected *p, unsigned char *data, int length,
+        Threadinfo *info) {
+    TRACE(forward, KIND_FRAME, p->name, length);
+    if (p->framing && p->peer == NULL) {
+        outbox_frame(p, data, length, in_reader(info, data));
+        return;
+    }
+    char *text = frame_text(data, length);
+    if (text == NULL) {
+        count(&info->station->formatErr);
+        return;
+    }
+    deliver(p, "%s", text);
+    free(text);
+}
+
+/*
+ * process a framed train. Resource cargo followed by a plain next station
+ * is loaded straight from the frame and the rest of the frame passed on
+ * untouched, with no text to scan and no numbers to convert. Anything else
+ * is processed as the text train it stands for. Needs sem
+ */
+void process_frame(char *buffer, int length, Threadinfo *info) {
+    unsigned char *data = (unsigned char *)buffer;
+    Segment name, cargo, next;
+    int position = 0;
+    frame_segment(data, length, &position, &name);
+    if (frame_segment(data, length, &position, &cargo) == 0 ||
+            cargo.kind != SEGMENT_RESOURCES || segment_valid(&cargo) == 0 ||
+            (position < length && (frame_segment(data, length, &position,
+            &next) == 0 || next.kind != SEGMENT_TEXT ||
+            memchr(next.data, ':', next.length) != NULL ||
+            memchr(next.data, '\0', next.length) != NULL ||
+            memchr(next.data, '\n', next.length) != NULL ||
+            (next.length > 0 && next.data[0] == '[')))) {
+        char *text = frame_text(data, length);
+        if (text == NULL) {
+            count(&info->station->formatErr);
+            return;
+        }
+        process_train(text, info);
+        free(text);
+        return;
+    }
+    info->trainId = NULL;
+    TRACE(parse, KIND_RESOURCE, info->name, cargo.length);
+    int loaded = 0;
+    for (int at = 0; at < cargo.length; loaded++) {
+        char *n;
+        int nameLength;
+        long q;
+        segment_resource(&cargo, &at, &n, &nameLength, &q);
+        /* the byte after the name was its quantity, read already */
+        n[nameLength] = '\0';
+        load_resource(info, n, q, 0);
+    }
+    if (info->station->ring != NULL) {
+        ring_flush(info->station, info->connected);
+    }
+    TRACE(apply, KIND_RESOURCE, info->name, loaded);
+    (info->station->processed)++;
+    if (cargo.data + cargo.length == data + length) {
+        return;
+    }
+    char *hop = (char *)scratch_alloc(next.length + 1);
+    memcpy(hop, next.data, next.length);
+    hop[next.length] = '\0';
+    Connected *node = get_connected(info->connected, hop);
+    scratch_free(hop);
+    if (node == NULL || position == length) {
+        (info->station->noFwd)++;
+        return;
+    }
+    forward_frame(node, data + next.start, length - next.start, info);
+}
+
+/*
+ * return 1 if the first cargo of a train, length bytes at cargo, is one of
+ * the control trains stations keep their shared state with: resources
+ * handed over in the ring, query answers, routes, ring membership and
+ * stopping. Shedding one would lose that state without a trace
+ */
+int control_cargo(const char *cargo, int length) {
+    const char *controls[] = {"own(", "answer(", "query(", "route(",
+            "ring()", "stopstation", "doomtrain"};
+    for (int i = 0; i < sizeof(controls) / sizeof(controls[0]); i++) {
+        int size = strlen(controls[i]);
+        if (length >= size && memcmp(cargo, controls[i], size) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * take one of the peer's tokens for a train whose first cargo is length
+ * bytes at cargo, or count the train as shed. Control trains take no token.
+ * return 1 if the train may go on, otherwise return 0
+ */
+int admit_rate(Threadinfo *info, const char *cargo, int length) {
+    if (cargo != NULL && control_cargo(cargo, length)) {
+        return 1;
+    }
+    if (bucket_take(&info->bucket) == 0) {
+        count(&info->station->shed);
+        count(&info->self->shed);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * classify a train before taking the semaphore. Malformed and foreign trains
+ * are counted here and dropped, trains over the peer's rate are shed.
+ * return 1 if the train should go on to process_train, otherwise return 0
+ */
+int admit_train(char *buffer, Threadinfo *info) {
+    Station *station = info->station;
+    size_t length = strlen(station->name);
+    if (strchr(buffer, ':') == 0) {
+        count(&station->formatErr);
+        return 0;
+    }
+    if (strncmp(buffer, station->name, length) != 0 ||
+            buffer[length] != ':') {
+        count(&station->notMine);
+        return 0;
+    }
+    char *cargo = buffer + length + 1;
+    return admit_rate(info, cargo, strcspn(cargo, ":"));
+}
+
+/*
+ * classify a framed train before taking the semaphore, as admit_train()
+ * does. return 1 if the frame should go on to process_frame, otherwise 0
+ */
+int admit_frame(char *buffer, int length, Threadinfo *info) {
+    Station *station = info->station;
+    Segment name;
+    int position = 0;
+    if (frame_segment((unsigned char *)buffer, length, &position,
+            &name) == 0 || position == length) {
+        count(&station->formatErr);
+        return 0;
+    }
+    if (name.kind != SEGMENT_TEXT || name.length != strlen(station->name) ||
+            memcmp(name.data, station->name, name.length) != 0) {
+        count(&station->notMine);
         return 0;
     }
-    int stationNumber = 0;
-    for (char *p = str; *p != '\0'; p++) {
-        if (*p == ',') {
-            stationNumber++;
+    Segment cargo;
+    if (frame_segment((unsigned char *)buffer, length, &position,
+            &cargo) == 0 || cargo.kind != SEGMENT_TEXT) {
+        return admit_rate(info, NULL, 0);
+    }
+    return admit_rate(info, (char *)cargo.data, cargo.length);
+}
+
+/*
+ * process the trains co-hosted tenants sent each other, in the order they
+ * were sent, including any they send while being processed. Needs sem
+ */
+void drain_local(void) {
+    while (pending != NULL) {
+        Pending *p = pending;
+        if ((pending = p->next) == NULL) {
+            pendingTail = NULL;
+        }
+        TRACE(receive, KIND_TEXT, p->info->name, strlen(p->line) + 1);
+        if (!p->info->station->stopped && admit_train(p->line, p->info)) {
+            process_train(p->line, p->info);
+        }
+        free(p->line);
+        free(p);
+    }
+}
+
+/*
+ * append a train as received from the peer to the capture file, along with
+ * the time since the previous captured train
+ */
+void capture_train(char *buffer, Threadinfo *info) {
+    Station *station = info->station;
+    Record *record = &info->capture;
+    struct timespec now;
+    if (station->captureFp == NULL) {
+        return;
+    }
+    sem_wait(&captureSem);
+    if (info->captureId < 0) {
+        info->captureId = station->capturePeers++;
+        record_varint(record, info->captureId);
+        record_string(record, info->name);
+        write_record(station->captureFp, CAPTURE_PEER, record);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    record_varint(record, info->captureId);
+    record_varint(record, (now.tv_sec - station->captureLast.tv_sec) *
+            1000000000L + (now.tv_nsec - station->captureLast.tv_nsec));
+    record_string(record, buffer);
+    write_record(station->captureFp, CAPTURE_TRAIN, record);
+    station->captureLast = now;
+    sem_post(&captureSem);
+}
+
+/* put the train just read from the peer back, for after an upgrade */
+void unread(Threadinfo *info) {
+    if (info->self->framing) {
+        reader_unframe(&info->reader);
+    } else {
+        reader_unread(&info->reader);
+    }
+}
+
+/*
+ * move the calling reader thread onto the next reader cpu, then give it a
+ * line buffer of its own: the kernel places pages where they are first
+ * touched, so the buffer lands on the reader's node rather than the
+ * listener's
+ */
+void pin_reader(Reader *reader) {
+    if (!placement.pinned) {
+        return;
+    }
+    int turn = __sync_fetch_and_add(&placement.next, 1) %
+            CPU_COUNT(&placement.readers);
+    cpu_set_t cpu;
+    CPU_ZERO(&cpu);
+    for (int i = 0; i < CPU_SETSIZE; i++) {
+        if (CPU_ISSET(i, &placement.readers) && turn-- == 0) {
+            CPU_SET(i, &cpu);
+            break;
+        }
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpu);
+    reader_resize(reader, reader->size);
+}
+
+/*
+ * read trains from connected station. Trains already in the reader's buffer
+ * are processed under one hold of sem, so what they forward to each peer
+ * goes out in one writev once the buffer has none left
+ */
+void *client_thread(void *arg) {
+    Threadinfo *info;
+    char *buffer;
+    info = (Threadinfo *)(int64_t)arg;
+    int framing = info->self->framing, length = 0, held = 0;
+    pin_reader(&info->reader);
+    scratch = &info->reader.arena;
+    while (1) {
+        arena_reset(scratch);
+        if (held && (info->station->upgrading ||
+                !reader_ready(&info->reader, framing))) {
+            flush_outboxes(0);
+            sem_post(&sem);
+            held = 0;
+        }
+        if (info->station->upgrading) {
+            park_thread(info->station);
+            continue;
+        }
+        if ((buffer = framing ? reader_frame(&info->reader, &length) :
+                reader_line(&info->reader)) == NULL) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        info->lastSeen = wheel.now;
+        TRACE(receive, framing ? KIND_FRAME : KIND_TEXT, info->name,
+                info->reader.start - info->reader.last);
+        /*
+         * empty frames are keepalives, and so are empty lines if this
+         * station sends keepalives itself; otherwise such a line is a
+         * malformed train
+         */
+        if (framing ? length == 0 : buffer[0] == '\0' &&
+                info->station->keepaliveTicks) {
+            continue;
+        } else if (info->station->upgrading) {
+            unread(info);
+            continue;
+        }
+        if (framing && info->station->captureFp != NULL) {
+            char *text = frame_text((unsigned char *)buffer, length);
+            if (text != NULL) {
+                capture_train(text, info);
+                free(text);
+            }
+        } else if (!framing) {
+            capture_train(buffer, info);
+        }
+        if (framing ? admit_frame(buffer, length, info) :
+                admit_train(buffer, info)) {
+            if (!held) {
+                sem_wait(&sem);
+                held = 1;
+            }
+            /*
+             * captured and admitted already, so it is processed even if an
+             * upgrade began meanwhile: the handoff waits for this thread to
+             * park, which it does before reading on
+             */
+            if (info->station->stopped) {
+                break;
+            }
+            if (framing) {
+                process_frame(buffer, length, info);
+            } else {
+                process_train(buffer, info);
+            }
+            drain_local();
+        }
+    }
+    fflush(stdout);
+    if (!held) {
+        sem_wait(&sem);
+    }
+    /* nothing may be left queued for a socket about to be closed */
+    flush_outboxes(1);
+    TRACE(disconnect, framing ? KIND_FRAME : KIND_TEXT, info->name,
+            info->reader.end - info->reader.start);
+    /* a link replaced by settle_duplicate() is already out of the list */
+    if (get_connected(info->connected, info->name) == info->self) {
+        remove_connected(info->connected, info->name);
+        log_connection(info->station, EVENT_DISCONNECT, info->name);
+        if (info->station->ring != NULL && info->self->ring) {
+            ring_build(info->station, info->connected, 1);
+        }
+    }
+    sem_post(&sem);
+    cancel_timer(&info->idleTimer);
+    cancel_timer(&info->keepaliveTimer);
+    close(info->fd);
+    __sync_fetch_and_sub(&info->station->readers, 1);
+    /* out of the list, so nothing else can reach the connection now */
+    if (info->self->outbox != NULL) {
+        free(info->self->outbox->copied);
+        free(info->self->outbox);
+    }
+    free(info->self);
+    free(info->capture.data);
+    arena_release(&info->reader.arena);
+    free(info);
+    pthread_exit(NULL);
+    return NULL;
+}
+
+/*
+ * read and get the auth string from the auth file
+ */
+void read_auth_file(FILE *authFile, Station *station) {
+    int length = 0;
+    char ch;
+    while (((ch = fgetc(authFile)) != EOF) && (ch != '\n')) {
+        length++;
+    }
+    if (length == 0) {
+        error(2);
+    }
+    station->auth = (char *)malloc(sizeof(char) * (length + 1));
+    rewind(authFile);
+    int i = 0;
+    while (((ch = fgetc(authFile)) != EOF) && (ch != '\r') && (ch != '\n')) {
+        station->auth[i] = ch;
+        i++;
+    }
+    station->auth[i] = '\0';
+}
+
+/* check if arguments are valid, if not, exit */
+void check_argu(int argc, char *argv[], Station *station) {
+    if (argc < 4 || argc > 6) {
+        error(1);
+    }
+    if (argv[1] == NULL || strlen(argv[1]) == 0) {
+        error(2);
+    } else {
+        station->name = argv[1];
+    }
+
+    FILE *authFile = fopen(argv[2], "r");
+    if (authFile == NULL) {
+        error(2);
+    } else {
+        read_auth_file(authFile, station);
+        fclose(authFile);
+    }
+
+    if ((station->logFp = fopen(argv[3],
+            (getenv("STATION_HANDOFF") != NULL) ? "a" : "w")) == NULL) {
+        error(3);
+    }
+    station->logfile = argv[3];
+
+    if (argc >= 5) {
+        if (strlen(argv[4]) == 0) {
+            error(4);
+        }
+        for (int i = 0; argv[4][i] != '\0'; i++) {
+            if (argv[4][i] < '0' || argv[4][i] > '9') {
+                error(4);
+            }
+        }
+        if (atoi(argv[4]) <= 0 || atoi(argv[4]) >= 65535) {
+            error(4);
+        }
+        station->port = atoi(argv[4]);
+    }
+    if (argc == 6) {
+        station->interface = atoi(argv[5]);
+    }
+}
+
+/*
+ * read the topology file, one port@host (as in add trains) or host@port
+ * entry per line, blank lines and lines starting with '#' are skipped
+ */
+void read_peer_file(char *path, Bootstrap *boot) {
+    FILE *peerFile = fopen(path, "r");
+    if (peerFile == NULL) {
+        error(9);
+    }
+    int size = 16;
+    boot->hosts = (char **)malloc(sizeof(char *) * size);
+    boot->ports = (int *)malloc(sizeof(int) * size);
+    boot->count = 0;
+    char *line;
+    while ((line = read_line(peerFile)) != NULL) {
+        char *at = strchr(line, '@');
+        if (line[0] == '#' || strlen(line) == 0) {
+            free(line);
+            continue;
+        }
+        if (at == NULL || at == line || *(at + 1) == '\0') {
+            error(9);
+        }
+        *at = '\0';
+        char *port = line, *host = at + 1;
+        if (strspn(port, "0123456789") != strlen(port)) {
+            port = at + 1;
+            host = line;
+        }
+        if (strspn(port, "0123456789") != strlen(port) || atoi(port) <= 0 ||
+                atoi(port) >= 65535) {
+            error(9);
+        }
+        if (boot->count == size) {
+            size *= 2;
+            boot->hosts = (char **)realloc(boot->hosts, sizeof(char *) * size);
+            boot->ports = (int *)realloc(boot->ports, sizeof(int) * size);
         }
+        boot->hosts[boot->count] = host;
+        boot->ports[boot->count] = atoi(port);
+        boot->count++;
     }
-    char *p = str;
-    char *next = NULL;
-    for (int i = 0; i < stationNumber; i++) {
-        next = strchr(p, ',') + 1;
-        *(strchr(p, ',')) = '\0';
-        char *host = NULL;
-        char *port = p;
-        host = strchr(p, '@') + 1;
-        *(strchr(p, '@')) = '\0';
-        if (connect_station(host, atoi(port), info) != 1) {
-            error(6);
+    fclose(peerFile);
+}
+
+/*
+ * take peers from the topology list until it is empty and connect to each,
+ * retrying with exponential backoff. Only the registration of a connected
+ * peer holds the semaphore, so workers dial and handshake in parallel. A
+ * peer that cannot be reached is reported and counted, and a second link
+ * to a peer that dialed this station too is settled by settle_duplicate().
+ */
+void *bootstrap_worker(void *arg) {
+    Bootstrap *boot = (Bootstrap *)arg;
+    int i;
+    while ((i = __sync_fetch_and_add(&boot->next, 1)) < boot->count) {
+        long delay = 50000000;
+        Reader reader;
+        char *name;
+        int fd, framing, attempt;
+        for (attempt = 0; (fd = dial_station(boot->hosts[i],
+                boot->ports[i], NULL, boot->station, &reader, &name,
+                &framing)) < 0 && attempt < boot->retries; attempt++) {
+            struct timespec wait = {delay / 1000000000, delay % 1000000000};
+            nanosleep(&wait, NULL);
+            delay = (delay * 2 > 2000000000) ? 2000000000 : delay * 2;
         }
-        p = next;
+        if (fd < 0) {
+            fprintf(stderr, "Unable to connect to %d@%s\n", boot->ports[i],
+                    boot->hosts[i]);
+            __sync_fetch_and_add(&boot->failed, 1);
+            continue;
+        }
+        sem_wait(&sem);
+        if (settle_duplicate(boot->connected, boot->station, name, 1)) {
+            sem_post(&sem);
+            arena_release(&reader.arena);
+            close(fd);
+            continue;
+        }
+        Connected *self = process_station(boot->connected, boot->station,
+                name, fd, framing);
+        self->dialed = 1;
+        TRACE(connect, KIND_DIALED, name, fd);
+        start_client_thread(fd, &reader, name, self, boot->station,
+                boot->connected, boot->resource);
+        sem_post(&sem);
     }
-    char *host = NULL;
-    char *port = p;
-    host = strchr(p, '@') + 1;
-    *(strchr(p, '@')) = '\0';
-    if (connect_station(host, atoi(port), info) != 1) {
-        error(6);
+    return NULL;
+}
+
+/*
+ * connect to every peer in the topology file with at most boot->parallel
+ * workers, then report "ready", the peer count and time taken on stdout,
+ * followed by "failed" and a count if some could not be reached
+ */
+void *bootstrap_thread(void *arg) {
+    Bootstrap *boot = (Bootstrap *)arg;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int workers = (boot->parallel < boot->count) ? boot->parallel :
+            boot->count;
+    pthread_t *threadIds = (pthread_t *)malloc(sizeof(pthread_t) * workers);
+    for (int i = 0; i < workers; i++) {
+        if (pthread_create(&threadIds[i], NULL, bootstrap_worker, boot) != 0) {
+            error(99);
+        }
     }
-    return 1;
+    for (int i = 0; i < workers; i++) {
+        pthread_join(threadIds[i], NULL);
+    }
+    free(threadIds);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("ready %d %.3f", boot->count, (end.tv_sec - start.tv_sec) +
+            (end.tv_nsec - start.tv_nsec) / 1e9);
+    if (boot->failed > 0) {
+        printf(" failed %d", boot->failed);
+    }
+    printf("\n");
+    fflush(stdout);
+    return NULL;
 }
 
 /*
- * check resource train's format. return 0 if the format is invalid
- * otherwise return 1
+ * if STATION_PEERS names a topology file, connect to its peers in the
+ * background while the listener is already accepting. STATION_PARALLEL
+ * bounds concurrent connects (default 16), STATION_RETRIES bounds the
+ * retries per peer (default 8) before giving up on it.
  */
-int resource_train_validation(char *str) {
-    int isDigit = 0;
-    int operator = 0;
-    int comma = 0;
-    int count = 0;
-    char *p = str;
-    if (*p == '+' || *p == '-' || *p == ',') {
-        return 0;
+void start_bootstrap(Station *station, Connected *connected,
+        Resource *resource) {
+    char *path = getenv("STATION_PEERS");
+    if (path == NULL || strlen(path) == 0) {
+        return;
     }
-    for (; *p != '\0'; p++) {
-        if (*p == '+' || *p == '-') {
-            if (count == 0) {
+    Bootstrap *boot;
+    if ((boot = (Bootstrap *)malloc(sizeof(Bootstrap))) == NULL) {
+        error(99);
+    }
+    read_peer_file(path, boot);
+    boot->next = 0;
+    boot->failed = 0;
+    boot->parallel = (getenv("STATION_PARALLEL") != NULL) ?
+            atoi(getenv("STATION_PARALLEL")) : 16;
+    boot->retries = (getenv("STATION_RETRIES") != NULL) ?
+            atoi(getenv("STATION_RETRIES")) : 8;
+    if (boot->parallel <= 0 || boot->retries < 0) {
+        error(9);
+    }
+    boot->station = station;
+    boot->connected = connected;
+    boot->resource = resource;
+    station->peered = 1;
+    pthread_t threadId;
+    if (pthread_create(&threadId, NULL, bootstrap_thread, boot) != 0) {
+        error(99);
+    }
+    pthread_detach(threadId);
+}
+
+/*
+ * read per-peer admission limits from the STATION_RATE environment variable,
+ * a comma separated list of name=rate[/burst] entries in trains per second.
+ * The name "*" (or an entry without a name) sets the default for all peers,
+ * and a rate of 0 leaves a peer unlimited.
+ */
+void read_rate_limits(Station *station) {
+    char *spec = getenv("STATION_RATE");
+    if (spec == NULL || strlen(spec) == 0) {
+        return;
+    }
+    spec = strdup(spec);
+    for (char *entry = strtok(spec, ","); entry != NULL;
+            entry = strtok(NULL, ",")) {
+        RateLimit *limit;
+        if ((limit = (RateLimit *)malloc(sizeof(RateLimit))) == NULL) {
+            error(99);
+        }
+        char *value = strchr(entry, '=');
+        if (value == NULL) {
+            limit->name = "*";
+            value = entry;
+        } else {
+            *value = '\0';
+            limit->name = entry;
+            value++;
+        }
+        char *end;
+        limit->rate = strtod(value, &end);
+        /* by default a second's worth of trains, but always at least one */
+        limit->burst = (limit->rate > 1) ? limit->rate : 1;
+        if (*end == '/') {
+            limit->burst = strtod(end + 1, &end);
+        }
+        /* a rate of 0 is no limit, so its burst does not matter */
+        if (*end != '\0' || end == value || limit->rate < 0 ||
+                (limit->rate > 0 && limit->burst < 1)) {
+            error(9);
+        }
+        limit->next = station->rateLimit;
+        station->rateLimit = limit;
+    }
+}
+
+/*
+ * choose the log format from the STATION_LOG environment variable, "text"
+ * (the default) or "binary", and write the binary log header if needed
+ */
+void open_event_log(Station *station) {
+    char *format = getenv("STATION_LOG");
+    if (format == NULL || strlen(format) == 0 || strcmp(format, "text") == 0) {
+        return;
+    } else if (strcmp(format, "binary") != 0) {
+        error(9);
+    }
+    station->logBinary = 1;
+    if (getenv("STATION_HANDOFF") != NULL) {
+        return;
+    }
+    fwrite(EVENTLOG_MAGIC, 1, EVENTLOG_MAGIC_LEN, station->logFp);
+    record_byte(&station->record, EVENTLOG_VERSION);
+    record_string(&station->record, station->name);
+    fwrite(station->record.data, 1, station->record.length, station->logFp);
+    station->record.length = 0;
+    fflush(station->logFp);
+}
+
+/*
+ * if STATION_CAPTURE names a file, record every incoming train into it
+ */
+void open_capture(Station *station) {
+    char *path = getenv("STATION_CAPTURE");
+    if (path == NULL || strlen(path) == 0) {
+        return;
+    }
+    if (getenv("STATION_HANDOFF") != NULL) {
+        if ((station->captureFp = fopen(path, "a")) == NULL) {
+            error(9);
+        }
+        return;
+    }
+    if ((station->captureFp = fopen(path, "w")) == NULL) {
+        error(9);
+    }
+    fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_LEN, station->captureFp);
+    fputc(CAPTURE_VERSION, station->captureFp);
+    clock_gettime(CLOCK_MONOTONIC, &station->captureLast);
+}
+
+/*
+ * read a timeout in milliseconds from environment variable name and return
+ * it in timer wheel ticks, or return def if it is not set
+ */
+unsigned long read_ticks(char *name, unsigned long def) {
+    char *value = getenv(name);
+    if (value == NULL || strlen(value) == 0) {
+        return def;
+    }
+    if (strspn(value, "0123456789") != strlen(value)) {
+        error(9);
+    }
+    return (strtoul(value, NULL, 10) + WHEEL_TICK - 1) / WHEEL_TICK;
+}
+
+/*
+ * read the connection timeouts, all in milliseconds and 0 to disable:
+ * STATION_IDLE drops peers that sent nothing for that long, STATION_KEEPALIVE
+ * sends an empty line to every peer that often, and STATION_HANDSHAKE
+ * (default 10000) bounds the wait for the auth/name handshake, and
+ * STATION_QUERY (default 1000) bounds how long a sum query waits for answers
+ */
+void read_timeouts(Station *station) {
+    station->idleTicks = read_ticks("STATION_IDLE", 0);
+    station->keepaliveTicks = read_ticks("STATION_KEEPALIVE", 0);
+    station->handshakeTicks = read_ticks("STATION_HANDSHAKE",
+            10000 / WHEEL_TICK);
+    station->queryTicks = read_ticks("STATION_QUERY", 1000 / WHEEL_TICK);
+    if (station->queryTicks == 0) {
+        error(9);
+    }
+}
+
+/*
+ * read STATION_DEDUP=ms[/ids]: remember train IDs for ms milliseconds,
+ * sized for ids trains in that time (default 1000000)
+ */
+void read_dedup(Station *station) {
+    char *value = getenv("STATION_DEDUP");
+    char *end;
+    if (value == NULL || strlen(value) == 0) {
+        return;
+    }
+    long ids = 1000000;
+    if ((end = strchr(value, '/')) != NULL) {
+        *end = '\0';
+    }
+    unsigned long window = read_ticks("STATION_DEDUP", 0);
+    if (end != NULL) {
+        *end = '/';
+        if (strlen(end + 1) == 0 ||
+                strspn(end + 1, "0123456789") != strlen(end + 1) ||
+                (ids = atol(end + 1)) <= 0 || ids > 1000000000) {
+            error(9);
+        }
+    }
+    if (window == 0) {
+        error(9);
+    }
+    Dedup *dedup;
+    if ((dedup = (Dedup *)malloc(sizeof(Dedup))) == NULL) {
+        error(99);
+    }
+    dedup->current = 0;
+    dedup->period = (window + DEDUP_GENERATIONS - 2) /
+            (DEDUP_GENERATIONS - 1);
+    dedup->capacity = (ids + DEDUP_GENERATIONS - 2) / (DEDUP_GENERATIONS - 1);
+    /* about 12 filter bits per ID, and tables at most 90% full */
+    dedup->blockNumber = dedup->capacity * 12 / 512 + 1;
+    dedup->bucketNumber = dedup->capacity * 10 / (DEDUP_SLOTS * 9) + 1;
+    for (int i = 0; i < DEDUP_GENERATIONS; i++) {
+        if ((dedup->generations[i].filter = calloc(dedup->blockNumber,
+                sizeof(*dedup->generations[i].filter))) == NULL ||
+                (dedup->generations[i].buckets = calloc(dedup->bucketNumber,
+                sizeof(*dedup->generations[i].buckets))) == NULL) {
+            error(99);
+        }
+        dedup->generations[i].started = 0;
+        dedup->generations[i].count = 0;
+    }
+    station->dedup = dedup;
+}
+
+/*
+ * read STATION_RING=points: partition resources over the ring stations
+ * connected to this one, with that many points per station on the ring
+ */
+void read_ring(Station *station) {
+    char *value = getenv("STATION_RING");
+    if (value == NULL || strlen(value) == 0) {
+        return;
+    }
+    if (strspn(value, "0123456789") != strlen(value) || atoi(value) <= 0 ||
+            atoi(value) > 4096) {
+        error(9);
+    }
+    Ring *ring;
+    if ((ring = (Ring *)calloc(1, sizeof(Ring))) == NULL) {
+        error(99);
+    }
+    ring->points = atoi(value);
+    station->ring = ring;
+}
+
+/*
+ * read STATION_FRAMING=text|binary: with binary, offer length-prefixed
+ * frames (see frame.h) to every station this one connects to
+ */
+void read_framing(Station *station) {
+    char *value = getenv("STATION_FRAMING");
+    if (value == NULL || strlen(value) == 0 || strcmp(value, "text") == 0) {
+        return;
+    }
+    if (strcmp(value, "binary") != 0) {
+        error(9);
+    }
+    station->framing = 1;
+}
+
+/*
+ * read a cpu list such as "0-3,8" into set.
+ * return 0 if the list is invalid, otherwise return 1
+ */
+int read_cpu_list(char *str, cpu_set_t *set) {
+    char *end;
+    CPU_ZERO(set);
+    while (1) {
+        if (!isdigit(*str)) {
+            return 0;
+        }
+        long first = strtol(str, &end, 10), last = first;
+        if (*end == '-') {
+            if (!isdigit(*(end + 1))) {
                 return 0;
             }
-            count = 0;
-            isDigit = 1;
-            operator++;
-        } else if (*p == ',') {
-            if (count == 0) {
-                return 0;
+            last = strtol(end + 1, &end, 10);
+        }
+        if (last < first || last >= CPU_SETSIZE) {
+            return 0;
+        }
+        for (long i = first; i <= last; i++) {
+            CPU_SET(i, set);
+        }
+        if (*end != ',') {
+            return *end == '\0' || *end == '\n';
+        }
+        str = end + 1;
+    }
+}
+
+/*
+ * read STATION_CPUS=service[/readers]: pin the listener, timer and the other
+ * service threads to the cpus of the first list, and each reader thread to
+ * one cpu of the second in turn (the first list again if there is none)
+ */
+void read_placement(void) {
+    char *value = getenv("STATION_CPUS");
+    if (value == NULL || strlen(value) == 0) {
+        return;
+    }
+    value = strdup(value);
+    char *slash = strchr(value, '/');
+    if (slash != NULL) {
+        *slash = '\0';
+    }
+    cpu_set_t allowed, both;
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) < 0) {
+        error(99);
+    }
+    if (!read_cpu_list(value, &placement.service) ||
+            !read_cpu_list((slash != NULL) ? slash + 1 : value,
+            &placement.readers)) {
+        error(9);
+    }
+    CPU_AND(&both, &placement.service, &allowed);
+    if (!CPU_EQUAL(&both, &placement.service)) {
+        error(9);
+    }
+    CPU_AND(&both, &placement.readers, &allowed);
+    if (!CPU_EQUAL(&both, &placement.readers)) {
+        error(9);
+    }
+    free(value);
+    placement.pinned = 1;
+    /* threads started from here on inherit the service cpus */
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+            &placement.service);
+}
+
+/*
+ * read STATION_BATCH=us[/bytes]: hold the trains for each peer socket up to
+ * us microseconds, or until bytes of them (default BATCH_BYTES) wait, and
+ * send them with one write
+ */
+void read_batch(void) {
+    char *value = getenv("STATION_BATCH");
+    if (value == NULL || strlen(value) == 0) {
+        return;
+    }
+    value = strdup(value);
+    char *slash = strchr(value, '/');
+    long bytes = BATCH_BYTES, us;
+    if (slash != NULL) {
+        *slash = '\0';
+        if (strlen(slash + 1) == 0 ||
+                strspn(slash + 1, "0123456789") != strlen(slash + 1) ||
+                (bytes = atol(slash + 1)) < 1024 || bytes > FRAME_MAX) {
+            error(9);
+        }
+    }
+    if (strlen(value) == 0 || strspn(value, "0123456789") != strlen(value) ||
+            (us = atol(value)) <= 0 || us > 1000000) {
+        error(9);
+    }
+    free(value);
+    batch.delay = us * 1000;
+    batch.bytes = bytes;
+}
+
+/*
+ * send batched outboxes once their oldest train has waited out the delay,
+ * and sleep on batch.wake while none has a train
+ */
+void *batch_thread(void *arg) {
+    while (1) {
+        sem_wait(&sem);
+        flush_outboxes(0);
+        long due = 0;
+        for (Connected *p = queuedPeers; p != NULL;
+                p = p->outbox->nextQueued) {
+            if (due == 0 || p->outbox->since < due) {
+                due = p->outbox->since;
             }
-            count = 0;
-            isDigit = 0;
-            if (operator == 0) {
-                return 0;
+        }
+        batch.waiting = (due == 0);
+        sem_post(&sem);
+        if (due == 0) {
+            while (sem_wait(&batch.wake) != 0) {
             }
-            comma++;
+            continue;
+        }
+        due += batch.delay;
+        struct timespec at = {due / 1000000000L, due % 1000000000L};
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at,
+                NULL) != 0) {
+        }
+    }
+    return NULL;
+}
+
+/*
+ * read STATION_TRACE=entries: keep the last entries tracepoint hits (a
+ * power of two) in memory, dumped to the log file's name plus ".trace" on
+ * SIGHUP
+ */
+void read_trace(Station *station) {
+    char *value = getenv("STATION_TRACE");
+    if (value == NULL || strlen(value) == 0) {
+        return;
+    }
+    long entries;
+    if (strspn(value, "0123456789") != strlen(value) ||
+            (entries = atol(value)) < 2 || entries > (1L << 24) ||
+            (entries & (entries - 1)) != 0) {
+        error(9);
+    }
+    if ((traceRing.entries = (TraceEntry *)calloc(entries,
+            sizeof(TraceEntry))) == NULL ||
+            asprintf(&traceRing.path, "%s.trace", station->logfile) < 0) {
+        error(99);
+    }
+    traceRing.started = now_ns();
+    traceRing.mask = entries - 1;
+}
+
+/*
+ * read STATION_ARENA=bytes: the block size of connection arenas, also
+ * putting the bytes each peer holds in the dumps
+ */
+void read_arena(void) {
+    char *value = getenv("STATION_ARENA");
+    if (value == NULL || strlen(value) == 0) {
+        return;
+    }
+    long bytes;
+    if (strspn(value, "0123456789") != strlen(value) ||
+            (bytes = atol(value)) < 64 || bytes > 4096) {
+        error(9);
+    }
+    arenaBlock = bytes;
+    arenaLogged = 1;
+}
+
+/* start the batch thread if STATION_BATCH is set */
+void start_batch(void) {
+    pthread_t threadId;
+    if (batch.delay == 0) {
+        return;
+    }
+    if (sem_init(&batch.wake, 0, 0) == -1 ||
+            pthread_create(&threadId, NULL, batch_thread, NULL) != 0) {
+        error(99);
+    }
+    pthread_detach(threadId);
+}
+
+/* print set as a cpu list such as "0-3,8" */
+void print_cpus(cpu_set_t *set) {
+    char *separator = "";
+    for (int i = 0; i < CPU_SETSIZE; i++) {
+        if (!CPU_ISSET(i, set)) {
+            continue;
+        }
+        int last = i;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set)) {
+            last++;
+        }
+        if (last > i) {
+            printf("%s%d-%d", separator, i, last);
         } else {
-            if (isDigit == 1 && (*p < '0' || *p > '9')) {
-                return 0;
+            printf("%s%d", separator, i);
+        }
+        separator = ",";
+        i = last;
+    }
+}
+
+/* print the NUMA nodes the cpus of set belong to, as sysfs reports them */
+void print_nodes(cpu_set_t *set) {
+    DIR *dir = opendir("/sys/devices/system/node");
+    struct dirent *entry;
+    cpu_set_t nodes, cpus;
+    int node;
+    CPU_ZERO(&nodes);
+    while (dir != NULL && (entry = readdir(dir)) != NULL) {
+        char path[300], line[4096];
+        if (sscanf(entry->d_name, "node%d", &node) != 1 || node < 0 ||
+                node >= CPU_SETSIZE) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist",
+                entry->d_name);
+        FILE *listFile = fopen(path, "r");
+        if (listFile == NULL) {
+            continue;
+        }
+        if (fgets(line, sizeof(line), listFile) != NULL &&
+                read_cpu_list(line, &cpus)) {
+            CPU_AND(&cpus, &cpus, set);
+            if (CPU_COUNT(&cpus) > 0) {
+                CPU_SET(node, &nodes);
             }
-            count++;
         }
+        fclose(listFile);
+    }
+    if (dir != NULL) {
+        closedir(dir);
+    }
+    if (CPU_COUNT(&nodes) == 0) {
+        printf("unknown");
+    } else {
+        print_cpus(&nodes);
+    }
+}
+
+/* print where STATION_CPUS placed the threads, after the port */
+void report_placement(void) {
+    if (!placement.pinned) {
+        return;
+    }
+    printf("placement service ");
+    print_cpus(&placement.service);
+    printf(" (nodes ");
+    print_nodes(&placement.service);
+    printf(") readers ");
+    print_cpus(&placement.readers);
+    printf(" (nodes ");
+    print_nodes(&placement.readers);
+    printf(")\n");
+    fflush(stdout);
+}
+
+/*
+ * read STATION_TENANTS=name[,name...]: host these stations in this process
+ * as well, behind its port with its auth and settings, each logging to
+ * logfile.name. Peers pick one by sending "name/tenant" as their name
+ */
+void read_tenants(Tenant *primary) {
+    char *value = getenv("STATION_TENANTS");
+    Tenant *tail = primary;
+    tenants = primary;
+    if (value == NULL || strlen(value) == 0) {
+        return;
+    }
+    value = strdup(value);
+    for (char *name = strtok(value, ","); name != NULL;
+            name = strtok(NULL, ",")) {
+        if (strpbrk(name, ":/@") != NULL || find_tenant(name) != NULL) {
+            error(9);
+        }
+        Tenant *tenant = (Tenant *)malloc(sizeof(Tenant));
+        Station *station = (Station *)calloc(1, sizeof(Station));
+        Connected *connected = (Connected *)calloc(1, sizeof(Connected));
+        Resource *resource = (Resource *)calloc(1, sizeof(Resource));
+        if (tenant == NULL || station == NULL || connected == NULL ||
+                resource == NULL || asprintf(&station->logfile, "%s.%s",
+                primary->station->logfile, name) < 0) {
+            error(99);
+        }
+        connected->fd = -1;
+        resource->logId = -1;
+        station->name = name;
+        station->auth = primary->station->auth;
+        station->port = primary->station->port;
+        station->rateLimit = primary->station->rateLimit;
+        if ((station->logFp = fopen(station->logfile, "w")) == NULL) {
+            error(3);
+        }
+        open_event_log(station);
+        read_timeouts(station);
+        read_dedup(station);
+        read_ring(station);
+        read_framing(station);
+        tenant->station = station;
+        tenant->connected = connected;
+        tenant->resource = resource;
+        tenant->next = NULL;
+        tail->next = tenant;
+        tail = tenant;
     }
-    if (operator - comma != 1) {
+}
+
+/* empty handler for SIGUSR1, which only interrupts blocking reads */
+void wake_handler(int sig) {
+}
+
+/* handle SIGUSR2 by starting a live upgrade */
+void upgrade_handler(int sig) {
+    sem_post(&upgradeSem);
+}
+
+/*
+ * send record over the handoff socket as one length prefixed message,
+ * passing fd along with it if it is not -1. return 0 if sending failed
+ */
+int send_message(int sock, Record *record, int fd) {
+    uint32_t length = htonl(record->length);
+    struct iovec iov = {&length, sizeof(length)};
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    if (fd >= 0) {
+        message.msg_control = control.space;
+        message.msg_controllen = sizeof(control.space);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    if (sendmsg(sock, &message, MSG_NOSIGNAL) != sizeof(length)) {
         return 0;
     }
+    for (int sent = 0, got; sent < record->length; sent += got) {
+        if ((got = send(sock, record->data + sent, record->length - sent,
+                MSG_NOSIGNAL)) <= 0) {
+            return 0;
+        }
+    }
+    record->length = 0;
     return 1;
 }
 
 /*
- * handle resource train, check format first and then load/unlload them
+ * receive one message from the handoff socket into cursor, and the fd
+ * passed with it into fd (-1 if none). return 0 if the socket closed
  */
-int process_resource_train(char *str, Threadinfo *info) {
-    if (resource_train_validation(str) == 0) {
-        (info->station->formatErr)++;
+int receive_message(int sock, Cursor *cursor, int *fd) {
+    uint32_t length;
+    struct iovec iov = {&length, sizeof(length)};
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.space;
+    message.msg_controllen = sizeof(control.space);
+    if (recvmsg(sock, &message, MSG_WAITALL) != sizeof(length)) {
         return 0;
     }
-    int resourceNumber = 0;
-    for (char *p = str; *p != '\0'; p++) {
-        if (*p == ',') {
-            resourceNumber++;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    *fd = -1;
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    cursor->length = ntohl(length);
+    cursor->position = 0;
+    cursor->data = (unsigned char *)realloc(cursor->data, cursor->length + 1);
+    if (cursor->data == NULL) {
+        error(99);
+    }
+    for (int got = 0, part; got < cursor->length; got += part) {
+        if ((part = read(sock, cursor->data + got,
+                cursor->length - got)) <= 0) {
+            return 0;
         }
     }
+    return 1;
+}
 
-    char *p = str;
-    char *next = NULL;
-    for (int i = 0; i < resourceNumber; i++) {
-        next = strchr(p, ',') + 1;
-        *(strchr(p, ',')) = '\0';
-        char operator = (strchr(p, '+') != 0) ? '+' : '-';
-        char *number = NULL;
-        char *name = p;
-        number = strchr(p, operator) + 1;
-        *(strchr(p, operator)) = '\0';
-        int quantity = (operator == '+') ? atoi(number) : (0 - atoi(number));
-        process_resource(info->resource, name, quantity);
-        p = next;
+/* decode an unsigned varint from the cursor */
+unsigned long cursor_varint(Cursor *cursor) {
+    unsigned long value = 0;
+    int shift = 0;
+    unsigned char byte;
+    do {
+        if (cursor->position >= cursor->length || shift > 63) {
+            error(99);
+        }
+        byte = cursor->data[cursor->position++];
+        value |= (unsigned long)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return value;
+}
+
+/* decode a zigzag encoded signed varint from the cursor */
+long cursor_signed(Cursor *cursor) {
+    unsigned long value = cursor_varint(cursor);
+    return (value & 1) ? -(long)(value >> 1) - 1 : (long)(value >> 1);
+}
+
+/* decode a length prefixed string from the cursor into a new buffer */
+char *cursor_string(Cursor *cursor, int *length) {
+    int size = cursor_varint(cursor);
+    char *str;
+    if (size > cursor->length - cursor->position ||
+            (str = (char *)malloc(sizeof(char) * (size + 1))) == NULL) {
+        error(99);
     }
-    char operator = (strchr(p, '+') != 0) ? '+' : '-';
-    char *number = NULL;
-    char *name = p;
-    number = strchr(p, operator) + 1;
-    *(strchr(p, operator)) = '\0';
-    int quantity = (operator == '+') ? atoi(number) : (0 - atoi(number));
-    process_resource(info->resource, name, quantity);
-    return 1;
+    memcpy(str, cursor->data + cursor->position, size);
+    str[size] = '\0';
+    cursor->position += size;
+    if (length != NULL) {
+        *length = size;
+    }
+    return str;
 }
 
 /*
- * forward the string to other stations
+ * send the whole station over the handoff socket: the listening socket with
+ * the counters and resource ledger, then one message per peer with its
+ * socket, name and the bytes already read from it but not yet processed,
+ * then an empty message to finish. return 0 if sending failed
  */
-void process_fwd(char *str, Threadinfo *info) {
-    if (strchr(str, ':')) {
-        char *p = strchr(str, ':');
-        *p = '\0';
-        if (has_connected(info->connected, str)) {
-
-            FILE *writeF = fdopen(get_fd(info->connected, str), "w");
-            *p = ':';
-            fprintf(writeF, "%s\n", str);
-            fflush(writeF);
-        } else {
-            (info->station->noFwd)++;
-            return;
+int send_station(int sock, Upgrade *upgrade) {
+    Station *station = upgrade->station;
+    Record record = {NULL, 0, 0};
+    int counters[SNAPSHOT_COUNTERS] = {station->processed, station->notMine,
+            station->formatErr, station->noFwd, station->shed};
+    int resourceNumber = 0;
+    for (Resource *p = upgrade->resource->next; p != NULL; p = p->next) {
+        resourceNumber++;
+    }
+    for (int i = 0; i < SNAPSHOT_COUNTERS; i++) {
+        record_signed(&record, counters[i]);
+        record_signed(&record, station->logged[i]);
+    }
+    record_varint(&record, station->logNames);
+    record_varint(&record, station->capturePeers);
+    record_varint(&record, station->captureLast.tv_sec);
+    record_varint(&record, station->captureLast.tv_nsec);
+    record_varint(&record, resourceNumber);
+    for (Resource *p = upgrade->resource->next; p != NULL; p = p->next) {
+        record_string(&record, p->name);
+        record_signed(&record, p->quantity);
+        record_signed(&record, p->logId);
+    }
+    int routeNumber = 0;
+    for (Route *p = station->routes; p != NULL; p = p->next) {
+        routeNumber++;
+    }
+    record_varint(&record, routeNumber);
+    for (Route *p = station->routes; p != NULL; p = p->next) {
+        record_string(&record, p->name);
+        record_string(&record, (p->hop != NULL) ? p->hop : "");
+    }
+    Dedup *dedup = station->dedup;
+    record_varint(&record, station->duplicate);
+    record_varint(&record, station->loggedDuplicate);
+    record_varint(&record, (dedup != NULL) ? dedup->bucketNumber : 0);
+    record_varint(&record, (dedup != NULL) ? dedup->blockNumber : 0);
+    for (int i = 0; dedup != NULL && i < DEDUP_GENERATIONS; i++) {
+        record_varint(&record, dedup->generations[i].count);
+        record_varint(&record, wheel.now - dedup->generations[i].started);
+    }
+    if (dedup != NULL) {
+        record_varint(&record, dedup->current);
+    }
+    int sent = send_message(sock, &record, upgrade->fdServer);
+    for (int i = 0; dedup != NULL && sent && i < DEDUP_GENERATIONS; i++) {
+        int size = sizeof(*dedup->generations[i].filter) * dedup->blockNumber;
+        Record table = {(unsigned char *)dedup->generations[i].filter,
+                size, size};
+        sent = send_message(sock, &table, -1);
+        size = sizeof(*dedup->generations[i].buckets) * dedup->bucketNumber;
+        table.data = (unsigned char *)dedup->generations[i].buckets;
+        table.length = size;
+        sent = sent && send_message(sock, &table, -1);
+    }
+    for (Connected *p = upgrade->connected->next; sent && p != NULL;
+            p = p->next) {
+        Reader *reader = &p->info->reader;
+        record_string(&record, p->name);
+        record_varint(&record, p->shed);
+        record_varint(&record, p->ring);
+        record_varint(&record, p->framing);
+        record_varint(&record, reader->end - reader->start);
+        for (int i = reader->start; i < reader->end; i++) {
+            record_byte(&record, reader->data[i]);
         }
-    } else {
-        (info->station->noFwd)++;
-        return;
+        sent = send_message(sock, &record, p->fd);
     }
+    sent = sent && send_message(sock, &record, -1);
+    free(record.data);
+    return sent;
 }
 
 /*
- * main function to process a train string,
- * check the category of the train and handle it using
- * corresponding functions.
+ * start the new build with the same arguments and hand the station to it.
+ * Everyone else is parked and sem and the wheel are held, so nothing
+ * changes meanwhile. return 1 once the new station has taken over,
+ * or 0 if it failed and this station should carry on
  */
-void process_train(char *buffer, Threadinfo *info) {
-    if (strchr(buffer, ':') == 0) {
-        (info->station->formatErr)++;
-        return;
+int hand_off(Upgrade *upgrade) {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+        return 0;
     }
-    if (strstr(buffer, info->station->name) == buffer && 
-            *(buffer + strlen(info->station->name)) == ':') {
-        char *current = buffer + strlen(info->station->name) + 1;
-        char *next = NULL;
-        if (strlen(current) == 0) {
-            (info->station->formatErr)++;
-            return;
-        } else {
-            if (strchr(current, ':')) {
-                next = (strchr(current, ':')) + 1;
-                *(strchr(current, ':')) = '\0';
-            }
-            int fwdStatus = 0, exitStatus = 0;
-            if (strcmp(current, "doomtrain") == 0) {
-                process_doom_train(current, info);
-                (info->station->processed)++;
-                exitStatus = 1;
-            } else if (strcmp(current, "stopstation") == 0) {
-                (info->station->processed)++;
-                fwdStatus = 1;
-                exitStatus = 2;
-            } else if (strstr(current, "add(") == current) {
-                if ((fwdStatus = process_add_train(current, info)) == 1) {
-                    (info->station->processed)++;
-                }
-            } else if (strchr(current, '+') || strchr(current, '-')) {
-                if ((fwdStatus = process_resource_train(current, info)) == 1) {
-                    (info->station->processed)++;
-                }
-            } else {
-                (info->station->formatErr)++;
-                return;
-            }
-            if (next != NULL && fwdStatus) {
-                process_fwd(next, info);
-            }
-            if (exitStatus) {
-                print_log(exitStatus, info->station, 
-                        info->connected, info->resource);
-                exit(0);
-            }
+    fcntl(upgrade->fdServer, F_SETFD, FD_CLOEXEC);
+    fcntl(fileno(upgrade->station->logFp), F_SETFD, FD_CLOEXEC);
+    if (upgrade->station->captureFp != NULL) {
+        fcntl(fileno(upgrade->station->captureFp), F_SETFD, FD_CLOEXEC);
+    }
+    for (Connected *p = upgrade->connected->next; p != NULL; p = p->next) {
+        fcntl(p->fd, F_SETFD, FD_CLOEXEC);
+    }
+    fcntl(pair[0], F_SETFD, FD_CLOEXEC);
+    char handoff[32];
+    sprintf(handoff, "STATION_HANDOFF=%d", pair[1]);
+    extern char **environ;
+    int envc = 0;
+    while (environ[envc] != NULL) {
+        envc++;
+    }
+    char **envp = (char **)malloc(sizeof(char *) * (envc + 2));
+    memcpy(envp, environ, sizeof(char *) * envc);
+    envp[envc] = handoff;
+    envp[envc + 1] = NULL;
+    char *binary = (getenv("STATION_UPGRADE_BIN") != NULL) ?
+            getenv("STATION_UPGRADE_BIN") : upgrade->argv[0];
+    fflush(stdout);
+    fflush(upgrade->station->logFp);
+    if (upgrade->station->captureFp != NULL) {
+        fflush(upgrade->station->captureFp);
+    }
+    pid_t pid;
+    if (posix_spawnp(&pid, binary, NULL, NULL, upgrade->argv, envp) != 0) {
+        pid = -1;
+    }
+    free(envp);
+    close(pair[1]);
+    char ack = 0;
+    if (pid < 0 || !send_station(pair[0], upgrade) ||
+            read(pair[0], &ack, 1) != 1 || ack != '1') {
+        close(pair[0]);
+        if (pid > 0) {
+            kill(pid, SIGKILL);
+            waitpid(pid, NULL, 0);
         }
-    } else {
-        (info->station->notMine)++;
+        return 0;
     }
+    return 1;
 }
 
 /*
- * read trains from connected station
+ * wait for SIGUSR2, then park every reader thread and the accept loop,
+ * interrupting blocked reads with SIGUSR1, and hand everything over to a
+ * new instance. If the handoff fails, resume as before.
  */
-void *client_thread(void *arg) {
-    Threadinfo *info;
-    char *buffer;
-    info = (Threadinfo *)(int64_t)arg;
+void *upgrade_thread(void *arg) {
+    Upgrade *upgrade = (Upgrade *)arg;
+    Station *station = upgrade->station;
     while (1) {
-        if ((buffer = read_line(info->fp)) == NULL) {
-            break;
-        } else {
+        if (sem_wait(&upgradeSem) != 0) {
+            continue;
+        }
+        /* the handoff carries one station, so a host of tenants stays */
+        if (tenants->next != NULL) {
+            fprintf(stderr, "Upgrade failed\n");
+            continue;
+        }
+        station->upgrading = 1;
+        while (station->parked < station->readers) {
+            pthread_kill(upgrade->acceptor, SIGUSR1);
             sem_wait(&sem);
-            process_train(buffer, info);
+            for (Connected *p = upgrade->connected->next; p != NULL;
+                    p = p->next) {
+                Threadinfo *info = __atomic_load_n(&p->info,
+                        __ATOMIC_ACQUIRE);
+                if (info != NULL) {
+                    pthread_kill(info->thread, SIGUSR1);
+                }
+            }
             sem_post(&sem);
+            struct timespec wait = {0, 1000000};
+            nanosleep(&wait, NULL);
+        }
+        sem_wait(&sem);
+        sem_wait(&wheel.lock);
+        flush_outboxes(1);
+        if (hand_off(upgrade)) {
+            _exit(0);
+        }
+        station->upgrading = 0;
+        sem_post(&wheel.lock);
+        sem_post(&sem);
+        for (int i = station->parked; i > 0; i--) {
+            sem_post(&parkSem);
         }
+        fprintf(stderr, "Upgrade failed\n");
     }
-    fflush(stdout);
-    sem_wait(&sem);
-    remove_connected(info->connected, info->name);
-    sem_post(&sem);
-    close(info->fd);
-    pthread_exit(NULL);
     return NULL;
 }
 
 /*
- * read and get the auth string from the auth file
+ * install the upgrade signal handlers and start the thread that waits for
+ * SIGUSR2. The calling thread is the accept loop.
  */
-void read_auth_file(FILE *authFile, Station *station) {
-    int length = 0;
-    char ch;
-    while (((ch = fgetc(authFile)) != EOF) && (ch != '\n')) {
-        length++;
+void start_upgrader(Station *station, Connected *connected,
+        Resource *resource, int fdServer, char **argv) {
+    Upgrade *upgrade;
+    if ((upgrade = (Upgrade *)malloc(sizeof(Upgrade))) == NULL) {
+        error(99);
     }
-    if (length == 0) {
-        error(2);
+    upgrade->station = station;
+    upgrade->connected = connected;
+    upgrade->resource = resource;
+    upgrade->fdServer = fdServer;
+    upgrade->acceptor = pthread_self();
+    upgrade->argv = argv;
+    station->readers++;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = &wake_handler;
+    sigaction(SIGUSR1, &sa, 0);
+    sa.sa_handler = &upgrade_handler;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR2, &sa, 0);
+    pthread_t threadId;
+    if (pthread_create(&threadId, NULL, upgrade_thread, upgrade) != 0) {
+        error(99);
     }
-    station->auth = (char *)malloc(sizeof(char) * (length + 1));
-    rewind(authFile);
-    int i = 0;
-    while (((ch = fgetc(authFile)) != EOF) && (ch != '\r') && (ch != '\n')) {
-        station->auth[i] = ch;
-        i++;
+    pthread_detach(threadId);
+}
+
+/*
+ * read the dedup cache the old station sent after its state, keeping it
+ * only if this station's cache has the same size
+ */
+void handoff_dedup(int sock, Station *station, Cursor *cursor) {
+    Dedup *dedup = station->dedup;
+    int bucketNumber = cursor_varint(cursor);
+    int blockNumber = cursor_varint(cursor);
+    int counts[DEDUP_GENERATIONS];
+    unsigned long ages[DEDUP_GENERATIONS];
+    if (bucketNumber == 0) {
+        return;
     }
-    station->auth[i] = '\0';
+    for (int i = 0; i < DEDUP_GENERATIONS; i++) {
+        counts[i] = cursor_varint(cursor);
+        ages[i] = cursor_varint(cursor);
+    }
+    int current = cursor_varint(cursor);
+    int keep = (dedup != NULL && dedup->bucketNumber == bucketNumber &&
+            dedup->blockNumber == blockNumber);
+    Cursor filter = {NULL, 0, 0}, table = {NULL, 0, 0};
+    for (int i = 0; i < DEDUP_GENERATIONS; i++) {
+        int fd;
+        if (!receive_message(sock, &filter, &fd) ||
+                !receive_message(sock, &table, &fd)) {
+            error(99);
+        }
+        if (keep) {
+            memcpy(dedup->generations[i].filter, filter.data, filter.length);
+            memcpy(dedup->generations[i].buckets, table.data, table.length);
+            dedup->generations[i].count = counts[i];
+            dedup->generations[i].started = wheel.now - ages[i];
+        }
+    }
+    if (keep) {
+        dedup->current = current;
+    }
+    free(filter.data);
+    free(table.data);
 }
 
-/* check if arguments are valid, if not, exit */
-void check_argu(int argc, char *argv[], Station *station) {
-    if (argc < 4 || argc > 6) {
-        error(1);
+/*
+ * take over from the station that exec'd us: rebuild its counters, ledger
+ * and peers from the handoff socket in STATION_HANDOFF, start a reader for
+ * every peer and acknowledge. return the listening socket
+ */
+int receive_handoff(Station *station, Connected *connected,
+        Resource *resource) {
+    int sock = atoi(getenv("STATION_HANDOFF"));
+    int fdServer, fd;
+    Cursor cursor = {NULL, 0, 0};
+    unsetenv("STATION_HANDOFF");
+    if (!receive_message(sock, &cursor, &fdServer) || fdServer < 0) {
+        error(99);
     }
-    if (argv[1] == NULL || strlen(argv[1]) == 0) {
-        error(2);
-    } else {
-        station->name = argv[1];
+    int *counters[SNAPSHOT_COUNTERS] = {&station->processed,
+            &station->notMine, &station->formatErr, &station->noFwd,
+            &station->shed};
+    for (int i = 0; i < SNAPSHOT_COUNTERS; i++) {
+        *counters[i] = cursor_signed(&cursor);
+        station->logged[i] = cursor_signed(&cursor);
+    }
+    station->logNames = cursor_varint(&cursor);
+    station->capturePeers = cursor_varint(&cursor);
+    station->captureLast.tv_sec = cursor_varint(&cursor);
+    station->captureLast.tv_nsec = cursor_varint(&cursor);
+    int resourceNumber = cursor_varint(&cursor);
+    Resource *tail = resource;
+    for (int i = 0; i < resourceNumber; i++) {
+        Resource *new;
+        if ((new = (Resource *)malloc(sizeof(Resource))) == NULL) {
+            error(99);
+        }
+        new->name = cursor_string(&cursor, NULL);
+        new->quantity = cursor_signed(&cursor);
+        new->logId = cursor_signed(&cursor);
+        new->next = NULL;
+        tail->next = new;
+        tail = new;
+        index_resource(station, new);
+    }
+    int routeNumber = cursor_varint(&cursor);
+    for (int i = 0; i < routeNumber; i++) {
+        char *name = cursor_string(&cursor, NULL);
+        char *hop = cursor_string(&cursor, NULL);
+        set_route(station, name, (*hop != '\0') ? hop : NULL);
+        free(name);
+        free(hop);
+    }
+    station->duplicate = cursor_varint(&cursor);
+    station->loggedDuplicate = cursor_varint(&cursor);
+    handoff_dedup(sock, station, &cursor);
+    /* readers wait until every peer is connected before forwarding */
+    sem_wait(&sem);
+    while (receive_message(sock, &cursor, &fd) && fd >= 0) {
+        int pending, size;
+        Reader reader;
+        reader_init(&reader, fd, &station->upgrading);
+        char *name = cursor_string(&cursor, NULL);
+        Connected *self = add_connected(connected,
+                arena_strdup(&reader.arena, name), fd);
+        free(name);
+        self->shed = cursor_varint(&cursor);
+        self->ring = cursor_varint(&cursor);
+        self->framing = cursor_varint(&cursor);
+        char *bytes = cursor_string(&cursor, &pending);
+        size = reader.size;
+        while (size < pending) {
+            size *= 2;
+        }
+        if (size > reader.size) {
+            reader_resize(&reader, size);
+        }
+        memcpy(reader.data, bytes, pending);
+        reader.end = pending;
+        free(bytes);
+        fcntl(fd, F_SETFD, 0);
+        start_client_thread(fd, &reader, self->name, self, station,
+                connected, resource);
+    }
+    if (station->ring != NULL) {
+        ring_build(station, connected, 1);
+    }
+    sem_post(&sem);
+    fcntl(fdServer, F_SETFD, 0);
+    free(cursor.data);
+    if (write(sock, "1", 1) != 1) {
+        error(99);
     }
+    close(sock);
+    return fdServer;
+}
 
-    FILE *authFile = fopen(argv[2], "r");
-    if (authFile == NULL) {
-        error(2);
-    } else {
-        read_auth_file(authFile, station);
-        fclose(authFile);
+/*
+ * append what the trace ring recorded since the last dump to the trace
+ * file, one "seconds point kind peer size" line per hit. Entries written
+ * over since are counted as lost, entries still being written are skipped
+ */
+void trace_dump(void) {
+    FILE *traceFile;
+    if (traceRing.mask == 0 || (traceFile = fopen(traceRing.path, "a")) ==
+            NULL) {
+        return;
+    }
+    unsigned long end = __atomic_load_n(&traceRing.next, __ATOMIC_ACQUIRE);
+    unsigned long position = traceRing.dumped;
+    if (end - position > traceRing.mask + 1) {
+        fprintf(traceFile, "lost %lu\n", end - position - traceRing.mask - 1);
+        position = end - traceRing.mask - 1;
     }
+    for (; position < end; position++) {
+        TraceEntry *entry = &traceRing.entries[position & traceRing.mask];
+        if (__atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE) !=
+                position + 1) {
+            continue;
+        }
+        TraceEntry copy = *entry;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&entry->sequence, __ATOMIC_RELAXED) !=
+                position + 1) {
+            continue;
+        }
+        fprintf(traceFile, "%.6f %s %s %s %ld\n",
+                (copy.time - traceRing.started) / 1e9, copy.point,
+                kindNames[copy.kind], copy.peer, copy.size);
+    }
+    traceRing.dumped = end;
+    fclose(traceFile);
+}
 
-    FILE *temp = fopen(argv[3], "w");
-    if (temp == NULL) {
-        error(3);
-    } 
-    fclose(temp);
-    station->logfile = argv[3];
+/* handle SIGHUP by waking the dump thread */
+void sighup_handler(int sig) {
+    sem_post(&dumpSem);
+}
 
-    if (argc >= 5) {
-        if (strlen(argv[4]) == 0) {
-            error(4);
+/*
+ * wait for SIGHUP, then print the log of every tenant, flush the capture
+ * file and dump the trace ring. SIGHUP is blocked in every other thread, so the handler
+ * only ever interrupts this one, which holds no lock while waiting.
+ */
+void *dump_thread(void *arg) {
+    sigset_t hangup;
+    sigemptyset(&hangup);
+    sigaddset(&hangup, SIGHUP);
+    pthread_sigmask(SIG_UNBLOCK, &hangup, NULL);
+    while (1) {
+        if (sem_wait(&dumpSem) != 0) {
+            continue;
         }
-        for (int i = 0; argv[4][i] != '\0'; i++) {
-            if (argv[4][i] < '0' || argv[4][i] > '9') {
-                error(4);
+        sem_wait(&sem);
+        for (Tenant *p = tenants; p != NULL; p = p->next) {
+            if (!p->station->stopped) {
+                print_log(0, p->station, p->connected, p->resource);
             }
         }
-        if (atoi(argv[4]) <= 0 || atoi(argv[4]) >= 65535) {
-            error(4);
+        sem_post(&sem);
+        if (sigStation->captureFp != NULL) {
+            sem_wait(&captureSem);
+            fflush(sigStation->captureFp);
+            sem_post(&captureSem);
         }
-        station->port = atoi(argv[4]);
-    }
-    if (argc == 6) {
-        station->interface = atoi(argv[5]);
+        trace_dump();
     }
+    return NULL;
 }
 
-/* handle SIGHUP */
-void sighup_handler(int sig) {
-    sem_wait(&sem);
-    print_log(0, sigStation, sigConnected, sigResource);
-    sem_post(&sem);
+/* install the SIGHUP handler and start the thread doing the dumps */
+void start_dumper(void) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = &sighup_handler;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGHUP, &sa, 0);
+    pthread_t threadId;
+    if (pthread_create(&threadId, NULL, dump_thread, NULL) != 0) {
+        error(99);
+    }
+    pthread_detach(threadId);
 }
 
 int main(int argc, char *argv[]) {
-    if (sem_init(&sem, 0, 1) == -1) {
+    if (sem_init(&sem, 0, 1) == -1 || sem_init(&captureSem, 0, 1) == -1 ||
+            sem_init(&upgradeSem, 0, 0) == -1 ||
+            sem_init(&dumpSem, 0, 0) == -1 ||
+            sem_init(&parkSem, 0, 0) == -1) {
         error(99);
     }
 
-    Station station = {NULL, NULL, NULL, 0, 0, 0, 0, 0, 0};
-    Connected connected = {NULL, -1, NULL};
-    Resource resource = {NULL, 0, NULL};
+    /* blocked before any thread starts, so only the dump thread takes it */
+    sigset_t hangup;
+    sigemptyset(&hangup);
+    sigaddset(&hangup, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &hangup, NULL);
+    sigset_t wake;
+    sigemptyset(&wake);
+    sigaddset(&wake, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &wake, &wakeMask);
+
+    /* zeroed with only the exceptions named, as read_tenants() does */
+    Station station;
+    Connected connected;
+    Resource resource;
+    memset(&station, 0, sizeof(Station));
+    memset(&connected, 0, sizeof(Connected));
+    memset(&resource, 0, sizeof(Resource));
+    connected.fd = -1;
+    resource.logId = -1;
+    Tenant primary = {&station, &connected, &resource, NULL};
     check_argu(argc, argv, &station);
+    read_rate_limits(&station);
+    open_event_log(&station);
+    open_capture(&station);
+    read_timeouts(&station);
+    read_dedup(&station);
+    read_ring(&station);
+    read_framing(&station);
+    read_tenants(&primary);
+    read_placement();
+    read_batch();
+    read_arena();
+    read_trace(&station);
+    start_wheel();
+    start_batch();
+    start_keepalive(&station);
+    start_queries();
     sigStation = &station;
-    sigConnected = &connected;
-    sigResource = &resource;
-
-    struct sigaction sa;
-    sa.sa_handler = &sighup_handler;
-    sa.sa_flags = SA_RESTART;
-    sigaction(SIGHUP, &sa, 0);
+    start_dumper();
+    signal(SIGPIPE, SIG_IGN);
 
     int fdServer;
-    fdServer = open_listen(station.port, argc, argv);
+    if (getenv("STATION_HANDOFF") != NULL) {
+        fdServer = receive_handoff(&station, &connected, &resource);
+        report_placement();
+    } else {
+        fdServer = open_listen(station.port, argc, argv);
+        report_placement();
+        start_bootstrap(&station, &connected, &resource);
+    }
+    start_upgrader(&station, &connected, &resource, fdServer, argv);
     process_connections(fdServer, &station, &connected, &resource);
 }
\ No newline at end of file
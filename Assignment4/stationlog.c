@@ -0,0 +1,403 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "eventlog.h"
+
+/* a resource known to the log, indexed by its name id */
+typedef struct Resource {
+    char *name;
+    long quantity;
+} Resource;
+
+/* state rebuilt while reading the log */
+typedef struct Replay {
+    char *station;
+    int version;
+    Resource *resources;
+    int resourceNumber;
+    int resourceSize;
+    char **connected;
+    int connectedNumber;
+    int connectedSize;
+    long counters[SNAPSHOT_COUNTERS];
+    int flags;
+    char **shedNames;
+    long *shedCounts;
+    int shedNumber;
+    long duplicates;
+    char **memoryNames;
+    long *memoryBytes;
+    int memoryNumber;
+    int exitStatus;
+    long lastDelta;
+    long records[EVENT_EXIT + 1];
+    long dumps;
+} Replay;
+
+/* a record read from the log, "position" is the next byte to decode */
+typedef struct Record {
+    int type;
+    unsigned char *data;
+    unsigned long length;
+    unsigned long position;
+} Record;
+
+/* takes in error code, then print stderr message and exit program */
+void error(int errorCode) {
+    switch (errorCode) {
+        case 1:
+            fprintf(stderr, "Usage: station-log text logfile\n"\
+                    "       station-log get logfile resource...\n"\
+                    "       station-log history logfile resource\n"\
+                    "       station-log summary logfile\n");
+            exit(1);
+            break;
+        case 2:
+            fprintf(stderr, "Unable to open log\n");
+            exit(2);
+            break;
+        case 3:
+            fprintf(stderr, "Invalid log\n");
+            exit(3);
+            break;
+    }
+}
+
+/* read a varint from the file, exit on a truncated log */
+unsigned long file_varint(FILE *logFile) {
+    unsigned long value = 0;
+    int shift = 0, ch;
+    do {
+        if ((ch = fgetc(logFile)) == EOF || shift > 63) {
+            error(3);
+        }
+        value |= (unsigned long)(ch & 0x7f) << shift;
+        shift += 7;
+    } while (ch & 0x80);
+    return value;
+}
+
+/* decode an unsigned varint from the record */
+unsigned long record_varint(Record *record) {
+    unsigned long value = 0;
+    int shift = 0;
+    unsigned char byte;
+    do {
+        if (record->position >= record->length || shift > 63) {
+            error(3);
+        }
+        byte = record->data[record->position++];
+        value |= (unsigned long)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return value;
+}
+
+/* decode a zigzag encoded signed varint from the record */
+long record_signed(Record *record) {
+    unsigned long value = record_varint(record);
+    return (value & 1) ? -(long)(value >> 1) - 1 : (long)(value >> 1);
+}
+
+/* decode a length prefixed string from the record into a new buffer */
+char *record_string(Record *record) {
+    unsigned long length = record_varint(record);
+    if (length > record->length - record->position) {
+        error(3);
+    }
+    char *str = (char *)malloc(sizeof(char) * (length + 1));
+    memcpy(str, record->data + record->position, length);
+    str[length] = '\0';
+    record->position += length;
+    return str;
+}
+
+/*
+ * read the next record from the log into record
+ * return 0 at the end of the log, otherwise return 1
+ */
+int read_record(FILE *logFile, Record *record) {
+    int type = fgetc(logFile);
+    if (type == EOF) {
+        return 0;
+    }
+    record->type = type;
+    record->length = file_varint(logFile);
+    record->data = (unsigned char *)realloc(record->data,
+            record->length + 1);
+    if (fread(record->data, 1, record->length, logFile) != record->length) {
+        error(3);
+    }
+    record->position = 0;
+    return 1;
+}
+
+/* check the header and return the log positioned at the first record */
+FILE *open_log(char *path, Replay *replay) {
+    FILE *logFile = fopen(path, "rb");
+    char magic[EVENTLOG_MAGIC_LEN];
+    if (logFile == NULL) {
+        error(2);
+    }
+    if (fread(magic, 1, EVENTLOG_MAGIC_LEN, logFile) != EVENTLOG_MAGIC_LEN ||
+            memcmp(magic, EVENTLOG_MAGIC, EVENTLOG_MAGIC_LEN) != 0) {
+        error(3);
+    }
+    if ((replay->version = fgetc(logFile)) != EVENTLOG_VERSION) {
+        error(3);
+    }
+    unsigned long length = file_varint(logFile);
+    replay->station = (char *)malloc(sizeof(char) * (length + 1));
+    if (fread(replay->station, 1, length, logFile) != length) {
+        error(3);
+    }
+    replay->station[length] = '\0';
+    return logFile;
+}
+
+/* compare two resources by name, for qsort */
+int compare_resources(const void *a, const void *b) {
+    return strcmp((*(Resource * const *)a)->name,
+            (*(Resource * const *)b)->name);
+}
+
+/* keep the connected list sorted, as the station prints it */
+void add_connected(Replay *replay, char *n) {
+    if (replay->connectedNumber == replay->connectedSize) {
+        replay->connectedSize = (replay->connectedSize == 0) ? 16 :
+                replay->connectedSize * 2;
+        replay->connected = (char **)realloc(replay->connected,
+                sizeof(char *) * replay->connectedSize);
+    }
+    int i = replay->connectedNumber;
+    while (i > 0 && strcmp(replay->connected[i - 1], n) > 0) {
+        replay->connected[i] = replay->connected[i - 1];
+        i--;
+    }
+    replay->connected[i] = n;
+    replay->connectedNumber++;
+}
+
+/* remove station n from the connected list */
+void remove_connected(Replay *replay, char *n) {
+    for (int i = 0; i < replay->connectedNumber; i++) {
+        if (strcmp(replay->connected[i], n) == 0) {
+            free(replay->connected[i]);
+            memmove(replay->connected + i, replay->connected + i + 1,
+                    sizeof(char *) * (replay->connectedNumber - i - 1));
+            replay->connectedNumber--;
+            break;
+        }
+    }
+    free(n);
+}
+
+/* return the resource with name id, exit if it was never named */
+Resource *get_resource(Replay *replay, unsigned long id) {
+    if (id >= replay->resourceNumber) {
+        error(3);
+    }
+    return &replay->resources[id];
+}
+
+/* give the next name id to resource n */
+void add_resource(Replay *replay, unsigned long id, char *n) {
+    if (id != replay->resourceNumber) {
+        error(3);
+    }
+    if (replay->resourceNumber == replay->resourceSize) {
+        replay->resourceSize = (replay->resourceSize == 0) ? 64 :
+                replay->resourceSize * 2;
+        replay->resources = (Resource *)realloc(replay->resources,
+                sizeof(Resource) * replay->resourceSize);
+    }
+    replay->resources[id].name = n;
+    replay->resources[id].quantity = 0;
+    replay->resourceNumber++;
+}
+
+/* apply a snapshot record's counter changes, shed counts and peer bytes */
+void apply_snapshot(Replay *replay, Record *record) {
+    replay->flags = record_varint(record);
+    for (int i = 0; i < SNAPSHOT_COUNTERS; i++) {
+        replay->counters[i] += record_signed(record);
+    }
+    for (int i = 0; i < replay->shedNumber; i++) {
+        free(replay->shedNames[i]);
+    }
+    replay->shedNumber = record_varint(record);
+    replay->shedNames = (char **)realloc(replay->shedNames,
+            sizeof(char *) * (replay->shedNumber + 1));
+    replay->shedCounts = (long *)realloc(replay->shedCounts,
+            sizeof(long) * (replay->shedNumber + 1));
+    for (int i = 0; i < replay->shedNumber; i++) {
+        replay->shedNames[i] = record_string(record);
+        replay->shedCounts[i] = record_varint(record);
+    }
+    if (replay->flags & SNAPSHOT_DUPLICATE) {
+        replay->duplicates += record_signed(record);
+    }
+    for (int i = 0; i < replay->memoryNumber; i++) {
+        free(replay->memoryNames[i]);
+    }
+    replay->memoryNumber = (replay->flags & SNAPSHOT_MEMORY) ?
+            record_varint(record) : 0;
+    replay->memoryNames = (char **)realloc(replay->memoryNames,
+            sizeof(char *) * (replay->memoryNumber + 1));
+    replay->memoryBytes = (long *)realloc(replay->memoryBytes,
+            sizeof(long) * (replay->memoryNumber + 1));
+    for (int i = 0; i < replay->memoryNumber; i++) {
+        replay->memoryNames[i] = record_string(record);
+        replay->memoryBytes[i] = record_varint(record);
+    }
+    replay->dumps++;
+}
+
+/*
+ * apply one record to the replay state, record types this version does not
+ * know are skipped. return the resource id for name and delta records,
+ * otherwise return -1
+ */
+long apply_record(Replay *replay, Record *record) {
+    unsigned long id;
+    if (record->type <= EVENT_EXIT) {
+        replay->records[record->type]++;
+    }
+    switch (record->type) {
+        case EVENT_NAME:
+            id = record_varint(record);
+            add_resource(replay, id, record_string(record));
+            return id;
+        case EVENT_DELTA:
+            id = record_varint(record);
+            replay->lastDelta = record_signed(record);
+            get_resource(replay, id)->quantity += replay->lastDelta;
+            return id;
+        case EVENT_CONNECT:
+            add_connected(replay, record_string(record));
+            break;
+        case EVENT_DISCONNECT:
+            remove_connected(replay, record_string(record));
+            break;
+        case EVENT_SNAPSHOT:
+            apply_snapshot(replay, record);
+            break;
+        case EVENT_EXIT:
+            replay->exitStatus = record_varint(record);
+            break;
+    }
+    return -1;
+}
+
+/* print the current state in the station's text log format */
+void print_text(Replay *replay) {
+    printf("=======\n");
+    printf("%s\n", replay->station);
+    printf("Processed: %ld\n", replay->counters[0]);
+    printf("Not mine: %ld\n", replay->counters[1]);
+    printf("Format err: %ld\n", replay->counters[2]);
+    printf("No fwd: %ld\n", replay->counters[3]);
+    if (replay->flags & SNAPSHOT_SHED) {
+        printf("Shed: %ld", replay->counters[4]);
+        for (int i = 0; i < replay->shedNumber; i++) {
+            printf(" %s=%ld", replay->shedNames[i], replay->shedCounts[i]);
+        }
+        printf("\n");
+    }
+    if (replay->flags & SNAPSHOT_DUPLICATE) {
+        printf("Duplicate: %ld\n", replay->duplicates);
+    }
+    if (replay->flags & SNAPSHOT_MEMORY) {
+        long total = 0;
+        for (int i = 0; i < replay->memoryNumber; i++) {
+            total += replay->memoryBytes[i];
+        }
+        printf("Memory: %ld", total);
+        for (int i = 0; i < replay->memoryNumber; i++) {
+            printf(" %s=%ld", replay->memoryNames[i], replay->memoryBytes[i]);
+        }
+        printf("\n");
+    }
+    if (replay->connectedNumber == 0) {
+        printf("NONE\n");
+    } else {
+        for (int i = 0; i < replay->connectedNumber; i++) {
+            printf("%s%c", replay->connected[i],
+                    (i == replay->connectedNumber - 1) ? '\n' : ',');
+        }
+    }
+    Resource **sorted = (Resource **)malloc(sizeof(Resource *) *
+            (replay->resourceNumber + 1));
+    for (int i = 0; i < replay->resourceNumber; i++) {
+        sorted[i] = &replay->resources[i];
+    }
+    qsort(sorted, replay->resourceNumber, sizeof(Resource *),
+            compare_resources);
+    for (int i = 0; i < replay->resourceNumber; i++) {
+        printf("%s %ld\n", sorted[i]->name, sorted[i]->quantity);
+    }
+    free(sorted);
+    if (replay->exitStatus == 1) {
+        printf("doomtrain\n");
+    } else if (replay->exitStatus == 2) {
+        printf("stopstation\n");
+    }
+}
+
+/* find the name id of resource n, return -1 if it never appeared */
+long find_resource(Replay *replay, char *n) {
+    for (int i = 0; i < replay->resourceNumber; i++) {
+        if (strcmp(replay->resources[i].name, n) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        error(1);
+    }
+    char *command = argv[1];
+    if (!(strcmp(command, "text") == 0 && argc == 3) &&
+            !(strcmp(command, "get") == 0 && argc >= 4) &&
+            !(strcmp(command, "history") == 0 && argc == 4) &&
+            !(strcmp(command, "summary") == 0 && argc == 3)) {
+        error(1);
+    }
+    Replay replay;
+    memset(&replay, 0, sizeof(Replay));
+    Record record = {0, NULL, 0, 0};
+    FILE *logFile = open_log(argv[2], &replay);
+    long watched = -1;
+    while (read_record(logFile, &record)) {
+        long id = apply_record(&replay, &record);
+        if (strcmp(command, "text") == 0 && record.type == EVENT_SNAPSHOT) {
+            print_text(&replay);
+        } else if (strcmp(command, "history") == 0 && id >= 0) {
+            if (record.type == EVENT_NAME &&
+                    strcmp(replay.resources[id].name, argv[3]) == 0) {
+                watched = id;
+            } else if (record.type == EVENT_DELTA && id == watched) {
+                printf("dump %ld: %+ld = %ld\n", replay.dumps + 1,
+                        replay.lastDelta, replay.resources[id].quantity);
+            }
+        }
+    }
+    fclose(logFile);
+    if (strcmp(command, "get") == 0) {
+        for (int i = 3; i < argc; i++) {
+            long id = find_resource(&replay, argv[i]);
+            printf("%s %ld\n", argv[i],
+                    (id < 0) ? 0 : replay.resources[id].quantity);
+        }
+    } else if (strcmp(command, "summary") == 0) {
+        printf("%s: version %d, %ld dumps, %d resources, %d connected\n",
+                replay.station, replay.version, replay.dumps,
+                replay.resourceNumber, replay.connectedNumber);
+        printf("deltas %ld, connects %ld, disconnects %ld\n",
+                replay.records[EVENT_DELTA], replay.records[EVENT_CONNECT],
+                replay.records[EVENT_DISCONNECT]);
+    }
+    return 0;
+}